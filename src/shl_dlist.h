@@ -0,0 +1,107 @@
+/*
+ * SHL - Double Linked List
+ *
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * Double Linked List
+ * Intrusive, circular double linked list. A list head is a plain
+ * "struct shl_dlist" which points to itself if the list is empty. Entries
+ * embed a "struct shl_dlist" member and are converted back via
+ * shl_dlist_entry().
+ */
+
+#ifndef SHL_DLIST_H
+#define SHL_DLIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+/* miscellaneous */
+
+#define shl_dlist_offsetof(pointer, type, member) ({ \
+		const typeof(((type*)0)->member) *__ptr = (pointer); \
+		(type*)(((char*)__ptr) - offsetof(type, member)); \
+	})
+
+/* double linked list */
+
+struct shl_dlist {
+	struct shl_dlist *next;
+	struct shl_dlist *prev;
+};
+
+#define SHL_DLIST_INIT(head) { &(head), &(head) }
+
+static inline void shl_dlist_init(struct shl_dlist *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+
+static inline void shl_dlist__link(struct shl_dlist *prev,
+				   struct shl_dlist *n,
+				   struct shl_dlist *next)
+{
+	next->prev = n;
+	n->next = next;
+	n->prev = prev;
+	prev->next = n;
+}
+
+/* link @n right after @head, that is, at the front of the list */
+static inline void shl_dlist_link(struct shl_dlist *head,
+				  struct shl_dlist *n)
+{
+	shl_dlist__link(head, n, head->next);
+}
+
+/* link @n right before @head, that is, at the back of the list */
+static inline void shl_dlist_link_tail(struct shl_dlist *head,
+				       struct shl_dlist *n)
+{
+	shl_dlist__link(head->prev, n, head);
+}
+
+static inline void shl_dlist__unlink(struct shl_dlist *prev,
+				     struct shl_dlist *next)
+{
+	next->prev = prev;
+	prev->next = next;
+}
+
+static inline void shl_dlist_unlink(struct shl_dlist *e)
+{
+	shl_dlist__unlink(e->prev, e->next);
+	e->prev = NULL;
+	e->next = NULL;
+}
+
+static inline bool shl_dlist_empty(struct shl_dlist *head)
+{
+	return head->next == head;
+}
+
+#define shl_dlist_entry(ptr, type, member) \
+	shl_dlist_offsetof((ptr), type, member)
+
+#define shl_dlist_first(head, type, member) \
+	shl_dlist_entry((head)->next, type, member)
+
+#define shl_dlist_last(head, type, member) \
+	shl_dlist_entry((head)->prev, type, member)
+
+#define shl_dlist_for_each(iter, head) \
+	for (iter = (head)->next; iter != (head); iter = iter->next)
+
+#define shl_dlist_for_each_safe(iter, tmp, head) \
+	for (iter = (head)->next, tmp = iter->next; iter != (head); \
+	     iter = tmp, tmp = iter->next)
+
+#define shl_dlist_for_each_reverse_safe(iter, tmp, head) \
+	for (iter = (head)->prev, tmp = iter->prev; iter != (head); \
+	     iter = tmp, tmp = iter->prev)
+
+#endif  /* SHL_DLIST_H */
@@ -14,6 +14,7 @@
 #include <limits.h>
 #include <pty.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -21,12 +22,20 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/uio.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include "shl_pty.h"
 
-#define SHL_PTY_BUFSIZE 16384
+/* reads start at CHUNK_MIN bytes and grow up to BUFSIZE */
+#define SHL_PTY_BUFSIZE 65536
+#define SHL_PTY_CHUNK_MIN 4096
+/* default time budget of a dispatch in microseconds */
+#define SHL_PTY_BUDGET 4000
+/* events fetched per bridge dispatch */
+#define SHL_PTY_BRIDGE_EVENTS 64
 
 /*
  * Ring Buffer
@@ -37,6 +46,14 @@
  * Note that this allows users to use pty-writes for small data without
  * causing heavy allocations in the PTY layer. This is quite important for
  * keyboard-handling or other DEC-VT emulations.
+ *
+ * If @mirror is set, the buffer is backed by a memfd that is mapped twice,
+ * back to back. Byte i and byte i + size are then the same memory, so the
+ * data and the free space are always contiguous: peeks and reserves return
+ * a single iovec and pushes are a single memcpy(). Growing maps the file
+ * anew at twice the size; the data stays in the page cache and is not
+ * copied, except for the part that wrapped around. If the mapping cannot be
+ * set up, the ring silently falls back to a plain heap buffer.
  */
 
 struct ring {
@@ -44,10 +61,87 @@ struct ring {
 	size_t size;
 	size_t start;
 	size_t end;
+
+	bool mirror;
+	bool mapped;
+	int memfd;
 };
 
 #define RING_MASK(_r, _v) ((_v) & ((_r)->size - 1))
 
+static size_t ring_len(struct ring *r)
+{
+	return RING_MASK(r, r->end - r->start);
+}
+
+/* Map a memfd-backed mirrored buffer of size @nsize (see above). */
+static int ring_map(struct ring *r, size_t nsize)
+{
+	size_t page, len;
+	char *buf;
+	int fd;
+
+	/* both halves must be page-aligned; page sizes are powers of 2 */
+	page = sysconf(_SC_PAGESIZE);
+	if (nsize < page)
+		nsize = page;
+
+	if (r->mapped) {
+		fd = r->memfd;
+	} else {
+		fd = memfd_create("shl-pty-ring", MFD_CLOEXEC);
+		if (fd < 0)
+			return -errno;
+	}
+
+	if (ftruncate(fd, nsize) < 0)
+		goto error;
+
+	buf = mmap(NULL, 2 * nsize, PROT_NONE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (buf == MAP_FAILED)
+		goto error;
+
+	if (mmap(buf, nsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+		 fd, 0) == MAP_FAILED ||
+	    mmap(buf + nsize, nsize, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(buf, 2 * nsize);
+		goto error;
+	}
+
+	if (r->mapped) {
+		/* data that wrapped around moves behind the old end */
+		len = ring_len(r);
+		if (r->end < r->start) {
+			memcpy(&buf[r->size], buf, r->end);
+			r->end = r->start + len;
+		}
+		munmap(r->buf, 2 * r->size);
+	}
+
+	r->buf = buf;
+	r->size = nsize;
+	r->memfd = fd;
+	r->mapped = true;
+	return 0;
+
+error:
+	if (!r->mapped)
+		close(fd);
+	return -ENOMEM;
+}
+
+static void ring_free(struct ring *r)
+{
+	if (r->mapped) {
+		munmap(r->buf, 2 * r->size);
+		close(r->memfd);
+	} else {
+		free(r->buf);
+	}
+}
+
 /*
  * Resize ring-buffer to size @nsize. @nsize must be a power-of-2, otherwise
  * ring operations will behave incorrectly.
@@ -56,6 +150,13 @@ static int ring_resize(struct ring *r, size_t nsize)
 {
 	char *buf;
 
+	/* a heap buffer with data is never moved into a mapping */
+	if (r->mirror && (r->mapped || !r->buf)) {
+		if (ring_map(r, nsize) >= 0)
+			return 0;
+		r->mirror = false;
+	}
+
 	buf = malloc(nsize);
 	if (!buf)
 		return -ENOMEM;
@@ -76,7 +177,8 @@ static int ring_resize(struct ring *r, size_t nsize)
 		r->start = 0;
 	}
 
-	free(r->buf);
+	ring_free(r);
+	r->mapped = false;
 	r->buf = buf;
 	r->size = nsize;
 
@@ -146,6 +248,12 @@ static int ring_push(struct ring *r, const char *u8, size_t len)
 	if (err < 0)
 		return err;
 
+	if (r->mapped) {
+		memcpy(&r->buf[r->end], u8, len);
+		r->end = RING_MASK(r, r->end + len);
+		return 0;
+	}
+
 	if (r->start <= r->end) {
 		l = r->size - r->end;
 		if (l > len)
@@ -181,7 +289,11 @@ static int ring_push(struct ring *r, const char *u8, size_t len)
  */
 static size_t ring_peek(struct ring *r, struct iovec *vec)
 {
-	if (r->end > r->start) {
+	if (r->mapped && r->end != r->start) {
+		vec[0].iov_base = &r->buf[r->start];
+		vec[0].iov_len = ring_len(r);
+		return 1;
+	} else if (r->end > r->start) {
 		vec[0].iov_base = &r->buf[r->start];
 		vec[0].iov_len = r->end - r->start;
 		return 1;
@@ -196,6 +308,45 @@ static size_t ring_peek(struct ring *r, struct iovec *vec)
 	}
 }
 
+/*
+ * Get data pointers for the free space of the ring-buffer, in the order it
+ * will be filled. Like ring_peek(), this fills up to 2 iovecs and returns how
+ * many were used (0 meaning the buffer is full). Data written there becomes
+ * part of the buffer with ring_commit().
+ */
+static size_t ring_reserve(struct ring *r, struct iovec *vec)
+{
+	if (!r->size)
+		return 0;
+
+	/* never fill the last byte; "end == start" means empty */
+	if (r->mapped) {
+		vec[0].iov_base = &r->buf[r->end];
+		vec[0].iov_len = r->size - ring_len(r) - 1;
+		return vec[0].iov_len ? 1 : 0;
+	} else if (r->end < r->start) {
+		vec[0].iov_base = &r->buf[r->end];
+		vec[0].iov_len = r->start - r->end - 1;
+		return vec[0].iov_len ? 1 : 0;
+	}
+
+	vec[0].iov_base = &r->buf[r->end];
+	vec[0].iov_len = r->size - r->end - (r->start ? 0 : 1);
+	if (r->start > 1) {
+		vec[1].iov_base = r->buf;
+		vec[1].iov_len = r->start - 1;
+		return vec[0].iov_len ? 2 : 1;
+	}
+
+	return vec[0].iov_len ? 1 : 0;
+}
+
+/* Append @len bytes that were written into the space from ring_reserve(). */
+static void ring_commit(struct ring *r, size_t len)
+{
+	r->end = RING_MASK(r, r->end + len);
+}
+
 /*
  * Remove @len bytes from the start of the ring-buffer. Note that we protect
  * against overflows so removing more bytes than available is safe.
@@ -226,8 +377,11 @@ static void ring_pop(struct ring *r, size_t len)
 /*
  * PTY
  * A PTY object represents a single PTY connection between a master and a
- * child. The child process is fork()ed so the caller controls what program
- * will be run.
+ * child. With shl_pty_open(), the child process is fork()ed so the caller
+ * controls what program will be run. shl_pty_spawn() runs a given program
+ * with posix_spawn() instead. glibc implements that with
+ * clone(CLONE_VM | CLONE_VFORK), so the cost does not grow with the size of
+ * the caller; all tty setup that can be done from the parent is done there.
  *
  * Programs like /bin/login tend to perform a vhangup() on their TTY
  * before running the login procedure. This also causes the pty master
@@ -249,6 +403,15 @@ static void ring_pop(struct ring *r, size_t len)
  *
  * Note that shl_pty does not track SIGHUP, you need to do that yourself
  * and call shl_pty_close() once the client exited.
+ *
+ * By default, input is read into a small fixed buffer and passed to the
+ * input callback chunk by chunk. With shl_pty_set_ring(), input is instead
+ * read with readv() straight into the free space of a growable ring. The
+ * callback is then called after each read with @u8 set to NULL and @len set
+ * to everything buffered, and the data stays in the ring until the caller
+ * takes it with shl_pty_peek() and shl_pty_consume(). This avoids copying;
+ * batches are as large as the adaptive read size, or larger if the caller
+ * leaves data in the ring.
  */
 
 struct shl_pty {
@@ -256,6 +419,10 @@ struct shl_pty {
 	int fd;
 	pid_t child;
 	char in_buf[SHL_PTY_BUFSIZE];
+	size_t chunk;
+	int64_t budget;
+	struct ring in_ring;
+	size_t in_max;
 	struct ring out_buf;
 
 	shl_pty_input_cb cb;
@@ -290,9 +457,9 @@ static int pty_send(int fd, char d)
 	return (r == 1) ? 0 : -EINVAL;
 }
 
-static int pty_setup_child(int slave,
-			   unsigned short term_width,
-			   unsigned short term_height)
+static int pty_setup_tty(int slave,
+			 unsigned short term_width,
+			 unsigned short term_height)
 {
 	struct termios attr;
 	struct winsize ws;
@@ -315,6 +482,19 @@ static int pty_setup_child(int slave,
 	if (ioctl(slave, TIOCSWINSZ, &ws) < 0)
 		return -errno;
 
+	return 0;
+}
+
+static int pty_setup_child(int slave,
+			   unsigned short term_width,
+			   unsigned short term_height)
+{
+	int r;
+
+	r = pty_setup_tty(slave, term_width, term_height);
+	if (r < 0)
+		return r;
+
 	if (dup2(slave, STDIN_FILENO) != STDIN_FILENO ||
 	    dup2(slave, STDOUT_FILENO) != STDOUT_FILENO ||
 	    dup2(slave, STDERR_FILENO) != STDERR_FILENO)
@@ -447,6 +627,10 @@ pid_t shl_pty_open(struct shl_pty **out,
 	pty->child = pid;
 	pty->cb = cb;
 	pty->data = data;
+	pty->chunk = SHL_PTY_CHUNK_MIN;
+	pty->budget = SHL_PTY_BUDGET;
+	pty->in_ring.mirror = true;
+	pty->out_buf.mirror = true;
 
 	/* wait for child setup */
 	d = pty_recv(comm[0]);
@@ -462,6 +646,186 @@ pid_t shl_pty_open(struct shl_pty **out,
 	return pid;
 }
 
+/*
+ * Run @argv like execvpe() with @envp would. A name containing a slash is
+ * used as it is. Otherwise each directory of the PATH in @envp is tried
+ * until a candidate doesn't fail with ENOENT, ENOTDIR or EACCES. Only if
+ * @envp has no PATH, posix_spawnp() searches our own. Returns 0 or a positive
+ * error code, like posix_spawn().
+ */
+static int pty_spawn_path(pid_t *pid,
+			  const posix_spawn_file_actions_t *actions,
+			  const posix_spawnattr_t *attr,
+			  char *const *argv,
+			  char *const *envp)
+{
+	const char *path = NULL, *p, *end;
+	bool eacces = false;
+	size_t i, len, dlen;
+	char *buf;
+	int r;
+
+	if (strchr(argv[0], '/'))
+		return posix_spawn(pid, argv[0], actions, attr, argv, envp);
+	if (!*argv[0])
+		return ENOENT;
+
+	for (i = 0; envp && envp[i]; ++i) {
+		if (!strncmp(envp[i], "PATH=", 5)) {
+			path = &envp[i][5];
+			break;
+		}
+	}
+	if (!path)
+		return posix_spawnp(pid, argv[0], actions, attr, argv, envp);
+
+	len = strlen(argv[0]);
+	buf = malloc(strlen(path) + len + 2);
+	if (!buf)
+		return ENOMEM;
+
+	for (p = path; ; p = end + 1) {
+		end = strchrnul(p, ':');
+
+		/* an empty entry means the current directory */
+		dlen = end - p;
+		memcpy(buf, p, dlen);
+		if (dlen)
+			buf[dlen++] = '/';
+		memcpy(&buf[dlen], argv[0], len + 1);
+
+		r = posix_spawn(pid, buf, actions, attr, argv, envp);
+		if (r == EACCES)
+			eacces = true;
+		else if (r != ENOENT && r != ENOTDIR)
+			break;
+
+		if (!*end) {
+			r = eacces ? EACCES : ENOENT;
+			break;
+		}
+	}
+
+	free(buf);
+	return r;
+}
+
+/*
+ * Spawn @argv in a new pty, like shl_pty_open() followed by execvpe() in the
+ * child. A program name without a slash is searched for in the PATH of
+ * @envp; see pty_spawn_path(). The child starts with @envp, in @cwd if that
+ * is not NULL, in a new session with the pty as controlling tty, and with
+ * default signal dispositions and an empty signal mask.
+ *
+ * posix_spawn() only returns once the child has exec()ed or failed to, and
+ * reports the error in the latter case. That replaces the setup handshake of
+ * shl_pty_open(): on success the child is fully set up. Returns the pid of
+ * the child or a negative error code.
+ */
+pid_t shl_pty_spawn(struct shl_pty **out,
+		    shl_pty_input_cb cb,
+		    void *data,
+		    unsigned short term_width,
+		    unsigned short term_height,
+		    const char *cwd,
+		    char *const *argv,
+		    char *const *envp)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	struct shl_pty *pty;
+	char name[64];
+	sigset_t sigset;
+	int fd, slave, r;
+	pid_t pid;
+
+	pty = calloc(1, sizeof(*pty));
+	if (!pty)
+		return -ENOMEM;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC | O_NONBLOCK);
+	if (fd < 0) {
+		r = -errno;
+		goto err_free;
+	}
+
+	/* with devpts, grantpt() never needs the helper that requires default
+	 * signal handlers, so this is safe in the parent */
+	if (grantpt(fd) < 0 || unlockpt(fd) < 0) {
+		r = -errno;
+		goto err_fd;
+	}
+
+	r = ptsname_r(fd, name, sizeof(name));
+	if (r) {
+		r = -r;
+		goto err_fd;
+	}
+
+	/* keep the slave open until the child has it, so the settings stick */
+	slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (slave < 0) {
+		r = -errno;
+		goto err_fd;
+	}
+
+	r = pty_setup_tty(slave, term_width, term_height);
+	if (r < 0)
+		goto err_slave;
+
+	posix_spawnattr_init(&attr);
+	sigemptyset(&sigset);
+	posix_spawnattr_setsigmask(&attr, &sigset);
+	sigfillset(&sigset);
+	posix_spawnattr_setsigdefault(&attr, &sigset);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID |
+					POSIX_SPAWN_SETSIGMASK |
+					POSIX_SPAWN_SETSIGDEF);
+
+	/* file actions run after setsid(), and a session leader opening a tty
+	 * without O_NOCTTY acquires it as controlling tty */
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, name, O_RDWR,
+					 0);
+	posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO,
+					 STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO,
+					 STDERR_FILENO);
+	if (cwd)
+		posix_spawn_file_actions_addchdir_np(&actions, cwd);
+
+	r = pty_spawn_path(&pid, &actions, &attr, argv, envp);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	if (r) {
+		r = -r;
+		goto err_slave;
+	}
+
+	close(slave);
+
+	pty->ref = 1;
+	pty->fd = fd;
+	pty->child = pid;
+	pty->cb = cb;
+	pty->data = data;
+	pty->chunk = SHL_PTY_CHUNK_MIN;
+	pty->budget = SHL_PTY_BUDGET;
+	pty->in_ring.mirror = true;
+	pty->out_buf.mirror = true;
+
+	*out = pty;
+	return pid;
+
+err_slave:
+	close(slave);
+err_fd:
+	close(fd);
+err_free:
+	free(pty);
+	return r;
+}
+
 void shl_pty_ref(struct shl_pty *pty)
 {
 	if (!pty || !pty->ref)
@@ -476,7 +840,8 @@ void shl_pty_unref(struct shl_pty *pty)
 		return;
 
 	shl_pty_close(pty);
-	free(pty->out_buf.buf);
+	ring_free(&pty->in_ring);
+	ring_free(&pty->out_buf);
 	free(pty);
 }
 
@@ -520,34 +885,191 @@ static void pty_write(struct shl_pty *pty)
 		ring_pop(&pty->out_buf, (size_t)r);
 }
 
+static int64_t pty_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Adapt the read size to the throughput: a read that fills the whole chunk
+ * means the kernel has more queued, so the next one asks for twice as much.
+ * Mostly empty reads shrink the chunk again, so interactive output is handed
+ * to the callback in small pieces that are still hot in the cache.
+ */
+static void pty_adapt(struct shl_pty *pty, size_t len)
+{
+	if (len >= pty->chunk && pty->chunk < SHL_PTY_BUFSIZE)
+		pty->chunk *= 2;
+	else if (len < pty->chunk / 4 && pty->chunk > SHL_PTY_CHUNK_MIN)
+		pty->chunk /= 2;
+}
+
+static ssize_t pty_read_ring(struct shl_pty *pty)
+{
+	struct ring *r = &pty->in_ring;
+	struct iovec vec[2];
+	ssize_t len;
+	size_t n;
+
+	if (r->size < pty->in_max)
+		ring_grow(r, pty->chunk);
+
+	/* a full ring counts as running out of budget; the caller has to
+	 * consume and dispatch again */
+	n = ring_reserve(r, vec);
+	if (!n)
+		return -EAGAIN;
+
+	if (vec[0].iov_len >= pty->chunk) {
+		vec[0].iov_len = pty->chunk;
+		n = 1;
+	} else if (n > 1 && vec[0].iov_len + vec[1].iov_len > pty->chunk) {
+		vec[1].iov_len = pty->chunk - vec[0].iov_len;
+	}
+
+	len = readv(pty->fd, vec, (int)n);
+	if (len > 0) {
+		ring_commit(r, (size_t)len);
+		pty->cb(pty, NULL, ring_len(r), pty->data);
+	}
+
+	return len;
+}
+
 static int pty_read(struct shl_pty *pty)
 {
-	ssize_t len, num;
+	int64_t deadline = 0;
+	ssize_t len;
 
 	/* We're edge-triggered, means we need to read the whole queue. This,
 	 * however, might cause us to stall if the writer is faster than we
-	 * are. Therefore, we have some rather arbitrary limit on how fast
-	 * we read. If we reach it, we simply return EAGAIN to the caller and
-	 * let them deal with it. */
-	num = 50;
-	do {
-		len = read(pty->fd, pty->in_buf, sizeof(pty->in_buf));
-		if (len > 0)
-			pty->cb(pty, pty->in_buf, len, pty->data);
-	} while (len > 0 && --num);
+	 * are. Therefore, reading and handling the input may only take up
+	 * the time budget. If it is used up, we return EAGAIN and the caller
+	 * has to re-arm the fd and come back later. */
+	if (pty->budget)
+		deadline = pty_now() + pty->budget;
+
+	for (;;) {
+		if (pty->in_max) {
+			len = pty_read_ring(pty);
+			if (len == -EAGAIN)
+				return -EAGAIN;
+		} else {
+			len = read(pty->fd, pty->in_buf, pty->chunk);
+			if (len > 0)
+				pty->cb(pty, pty->in_buf, len, pty->data);
+		}
+
+		if (len <= 0)
+			return 0;
 
-	return !num ? -EAGAIN : 0;
+		pty_adapt(pty, len);
+		if (deadline && pty_now() >= deadline)
+			return -EAGAIN;
+	}
 }
 
+/*
+ * Hand queued input to the callback and flush pending output. Without a
+ * callback, nothing is read and the input stays in the kernel. The fd is
+ * edge-triggered, so input queued before the callback is set is only seen by
+ * a later dispatch: set it before adding the pty to a bridge, which checks
+ * the fd once on adding it, or dispatch again afterwards.
+ */
 int shl_pty_dispatch(struct shl_pty *pty)
 {
-	int r;
+	int r = 0;
 
-	r = pty_read(pty);
+	if (pty->cb)
+		r = pty_read(pty);
 	pty_write(pty);
 	return r;
 }
 
+/*
+ * Number of input bytes waiting for @pty: queued in the kernel plus, in ring
+ * mode, read but not yet consumed. Returns a negative error code on failure.
+ * Like everything else, this must be called from the thread dispatching the
+ * pty.
+ */
+ssize_t shl_pty_get_backlog(struct shl_pty *pty)
+{
+	int r, n;
+
+	if (!shl_pty_is_open(pty))
+		return -ENODEV;
+
+	r = ioctl(pty->fd, FIONREAD, &n);
+	if (r < 0)
+		return -errno;
+
+	return (ssize_t)n + ring_len(&pty->in_ring);
+}
+
+/*
+ * Replace the input callback. A pty can be spawned before whoever consumes
+ * its output exists; without a callback, nothing is read and the child's
+ * output waits in the kernel. See shl_pty_dispatch().
+ */
+void shl_pty_set_callback(struct shl_pty *pty, shl_pty_input_cb cb,
+			  void *data)
+{
+	pty->cb = cb;
+	pty->data = data;
+}
+
+/*
+ * Limit the time a single dispatch spends reading and handling input to
+ * @usec microseconds; 0 means reading until the kernel queue is empty. The
+ * default is SHL_PTY_BUDGET.
+ */
+void shl_pty_set_budget(struct shl_pty *pty, int64_t usec)
+{
+	pty->budget = usec > 0 ? usec : 0;
+}
+
+/*
+ * Switch @pty to ring mode (see above). The input ring grows up to @max bytes,
+ * rounded up to a power of two. Passing 0 switches back to the default mode;
+ * that fails with -EBUSY while unconsumed input is left.
+ */
+int shl_pty_set_ring(struct shl_pty *pty, size_t max)
+{
+	if (!max && pty->in_ring.start != pty->in_ring.end)
+		return -EBUSY;
+
+	pty->in_max = max;
+	return 0;
+}
+
+/*
+ * Get data pointers for the input buffered in ring mode. @vec must be an
+ * array of 2 iovecs; the number of iovecs filled is returned (0 meaning no
+ * input is buffered). The data stays valid until the next shl_pty_consume()
+ * or shl_pty_dispatch().
+ */
+size_t shl_pty_peek(struct shl_pty *pty, struct iovec *vec)
+{
+	return ring_peek(&pty->in_ring, vec);
+}
+
+/* Drop the first @len bytes of buffered input. */
+void shl_pty_consume(struct shl_pty *pty, size_t len)
+{
+	struct ring *r = &pty->in_ring;
+
+	ring_pop(r, len);
+
+	/* rewind an empty ring so the next read gets one contiguous chunk */
+	if (r->start == r->end) {
+		r->start = 0;
+		r->end = 0;
+	}
+}
+
 int shl_pty_write(struct shl_pty *pty, const char *u8, size_t len)
 {
 	if (!shl_pty_is_open(pty))
@@ -597,6 +1119,13 @@ int shl_pty_resize(struct shl_pty *pty,
  * This interface is provided to allow integration of PTYs into event-loops
  * that do not support edge-triggered interfaces. There is no other reason
  * to use this bridge.
+ *
+ * A dispatch fetches up to SHL_PTY_BRIDGE_EVENTS ready ptys at once and
+ * handles each of them once, so many busy ptys cost a single wakeup. Every
+ * pty is limited by its time budget. One that runs out is re-armed, which
+ * puts it at the end of epoll's ready list: everything else that is ready
+ * gets its turn before it is dispatched again, so ptys are served round-robin
+ * and a flood in one of them cannot starve the others.
  */
 
 int shl_pty_bridge_new(void)
@@ -615,37 +1144,49 @@ void shl_pty_bridge_free(int bridge)
 	close(bridge);
 }
 
+/*
+ * Dispatch all ptys that are ready, waiting up to @timeout milliseconds for
+ * the first one. Returns the number of ptys dispatched or a negative error
+ * code.
+ */
 int shl_pty_bridge_dispatch(int bridge, int timeout)
 {
-	struct epoll_event up, ev;
+	struct epoll_event up, ev[SHL_PTY_BRIDGE_EVENTS];
 	struct shl_pty *pty;
-	int fd, r;
+	int fd, r, i, n, err = 0;
 
-	r = epoll_wait(bridge, &ev, 1, timeout);
-	if (r < 0) {
+	n = epoll_wait(bridge, ev, SHL_PTY_BRIDGE_EVENTS, timeout);
+	if (n < 0) {
 		if (errno == EAGAIN || errno == EINTR)
 			return 0;
 
 		return -errno;
 	}
 
-	if (!r)
-		return 0;
+	for (i = 0; i < n; ++i) {
+		pty = ev[i].data.ptr;
+		r = shl_pty_dispatch(pty);
+		if (r != -EAGAIN)
+			continue;
+
+		/* EAGAIN means we ran out of budget, usually with data left.
+		 * There won't be another edge for it, but modifying the fd
+		 * makes epoll check its state again, so it is reported on the
+		 * next dispatch. If the queue drained just as the budget ran
+		 * out, that would be a wakeup for nothing; new input raises a
+		 * new edge anyway. */
+		if (!shl_pty_get_backlog(pty))
+			continue;
 
-	pty = ev.data.ptr;
-	r = shl_pty_dispatch(pty);
-	if (r == -EAGAIN) {
-		/* EAGAIN means we couldn't dispatch data fast enough. Modify
-		 * the fd in the epoll-set so we get edge-triggered events
-		 * next round. */
 		memset(&up, 0, sizeof(up));
 		up.events = EPOLLIN | EPOLLOUT | EPOLLET;
 		up.data.ptr = pty;
 		fd = shl_pty_get_fd(pty);
-		epoll_ctl(bridge, EPOLL_CTL_ADD, fd, &up);
+		if (epoll_ctl(bridge, EPOLL_CTL_MOD, fd, &up) < 0)
+			err = -errno;
 	}
 
-	return 0;
+	return err ? err : n;
 }
 
 int shl_pty_bridge_add(int bridge, struct shl_pty *pty)
@@ -17,6 +17,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 /* pty */
@@ -31,6 +32,14 @@ pid_t shl_pty_open(struct shl_pty **out,
 		   void *data,
 		   unsigned short term_width,
 		   unsigned short term_height);
+pid_t shl_pty_spawn(struct shl_pty **out,
+		    shl_pty_input_cb cb,
+		    void *data,
+		    unsigned short term_width,
+		    unsigned short term_height,
+		    const char *cwd,
+		    char *const *argv,
+		    char *const *envp);
 void shl_pty_ref(struct shl_pty *pty);
 void shl_pty_unref(struct shl_pty *pty);
 void shl_pty_close(struct shl_pty *pty);
@@ -38,8 +47,15 @@ void shl_pty_close(struct shl_pty *pty);
 bool shl_pty_is_open(struct shl_pty *pty);
 int shl_pty_get_fd(struct shl_pty *pty);
 pid_t shl_pty_get_child(struct shl_pty *pty);
+ssize_t shl_pty_get_backlog(struct shl_pty *pty);
 
 int shl_pty_dispatch(struct shl_pty *pty);
+void shl_pty_set_callback(struct shl_pty *pty, shl_pty_input_cb cb,
+			  void *data);
+void shl_pty_set_budget(struct shl_pty *pty, int64_t usec);
+int shl_pty_set_ring(struct shl_pty *pty, size_t max);
+size_t shl_pty_peek(struct shl_pty *pty, struct iovec *vec);
+void shl_pty_consume(struct shl_pty *pty, size_t len);
 int shl_pty_write(struct shl_pty *pty, const char *u8, size_t len);
 int shl_pty_signal(struct shl_pty *pty, int sig);
 int shl_pty_resize(struct shl_pty *pty,
@@ -0,0 +1,491 @@
+/*
+ * wlterm - built-in glyphs
+ *
+ * Copyright (c) 2017 Pamelloes <pamelloes@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Built-in Glyphs
+ * Box drawing (U+2500-U+257F), block elements (U+2580-U+259F) and braille
+ * (U+2800-U+28FF) fill the screen in most TUIs. Fonts often draw them a pixel
+ * too short or too narrow, so borders and bars show gaps, and fonts lacking
+ * them send pango through a fontconfig fallback lookup. We generate them from
+ * tables instead, directly as A8 masks of exactly the cell size.
+ *
+ * Lines are described by their four arms (up, right, down, left), each light,
+ * heavy or double. All arms of all characters use the same stroke positions,
+ * so they line up across cells. Where arms meet, each stroke is extended to
+ * the matching stroke of the crossing arms; for double lines that gives the
+ * usual inner and outer corners.
+ *
+ * Generated glyphs may end up in the persistent glyph cache, so any change to
+ * their output must bump DISK_VERSION in wlt_disk_cache.c.
+ */
+
+#include <cairo.h>
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wlterm.h"
+
+enum {
+	ARM_UP,
+	ARM_RIGHT,
+	ARM_DOWN,
+	ARM_LEFT,
+};
+
+enum {
+	LINE_NONE,
+	LINE_LIGHT,
+	LINE_HEAVY,
+	LINE_DOUBLE,
+};
+
+#define ARMS(u, r, d, l) ((u) | (r) << 2 | (d) << 4 | (l) << 6)
+#define ARM(arms, a) (((arms) >> ((a) * 2)) & 0x3)
+
+#define N LINE_NONE
+#define L LINE_LIGHT
+#define H LINE_HEAVY
+#define D LINE_DOUBLE
+
+/* U+2500 to U+257F; 0 marks characters with special handling */
+static const uint8_t box_arms[] = {
+	ARMS(N, L, N, L), ARMS(N, H, N, H), ARMS(L, N, L, N), ARMS(H, N, H, N),
+	0, 0, 0, 0,
+	0, 0, 0, 0,
+	ARMS(N, L, L, N), ARMS(N, H, L, N), ARMS(N, L, H, N), ARMS(N, H, H, N),
+	ARMS(N, N, L, L), ARMS(N, N, L, H), ARMS(N, N, H, L), ARMS(N, N, H, H),
+	ARMS(L, L, N, N), ARMS(L, H, N, N), ARMS(H, L, N, N), ARMS(H, H, N, N),
+	ARMS(L, N, N, L), ARMS(L, N, N, H), ARMS(H, N, N, L), ARMS(H, N, N, H),
+	ARMS(L, L, L, N), ARMS(L, H, L, N), ARMS(H, L, L, N), ARMS(L, L, H, N),
+	ARMS(H, L, H, N), ARMS(H, H, L, N), ARMS(L, H, H, N), ARMS(H, H, H, N),
+	ARMS(L, N, L, L), ARMS(L, N, L, H), ARMS(H, N, L, L), ARMS(L, N, H, L),
+	ARMS(H, N, H, L), ARMS(H, N, L, H), ARMS(L, N, H, H), ARMS(H, N, H, H),
+	ARMS(N, L, L, L), ARMS(N, L, L, H), ARMS(N, H, L, L), ARMS(N, H, L, H),
+	ARMS(N, L, H, L), ARMS(N, L, H, H), ARMS(N, H, H, L), ARMS(N, H, H, H),
+	ARMS(L, L, N, L), ARMS(L, L, N, H), ARMS(L, H, N, L), ARMS(L, H, N, H),
+	ARMS(H, L, N, L), ARMS(H, L, N, H), ARMS(H, H, N, L), ARMS(H, H, N, H),
+	ARMS(L, L, L, L), ARMS(L, L, L, H), ARMS(L, H, L, L), ARMS(L, H, L, H),
+	ARMS(H, L, L, L), ARMS(L, L, H, L), ARMS(H, L, H, L), ARMS(H, L, L, H),
+	ARMS(H, H, L, L), ARMS(L, L, H, H), ARMS(L, H, H, L), ARMS(H, H, L, H),
+	ARMS(L, H, H, H), ARMS(H, L, H, H), ARMS(H, H, H, L), ARMS(H, H, H, H),
+	0, 0, 0, 0,
+	ARMS(N, D, N, D), ARMS(D, N, D, N), ARMS(N, D, L, N), ARMS(N, L, D, N),
+	ARMS(N, D, D, N), ARMS(N, N, L, D), ARMS(N, N, D, L), ARMS(N, N, D, D),
+	ARMS(L, D, N, N), ARMS(D, L, N, N), ARMS(D, D, N, N), ARMS(L, N, N, D),
+	ARMS(D, N, N, L), ARMS(D, N, N, D), ARMS(L, D, L, N), ARMS(D, L, D, N),
+	ARMS(D, D, D, N), ARMS(L, N, L, D), ARMS(D, N, D, L), ARMS(D, N, D, D),
+	ARMS(N, D, L, D), ARMS(N, L, D, L), ARMS(N, D, D, D), ARMS(L, D, N, D),
+	ARMS(D, L, N, L), ARMS(D, D, N, D), ARMS(L, D, L, D), ARMS(D, L, D, L),
+	ARMS(D, D, D, D), 0, 0, 0,
+	0, 0, 0, 0,
+	ARMS(N, N, N, L), ARMS(L, N, N, N), ARMS(N, L, N, N), ARMS(N, N, L, N),
+	ARMS(N, N, N, H), ARMS(H, N, N, N), ARMS(N, H, N, N), ARMS(N, N, H, N),
+	ARMS(N, H, N, L), ARMS(L, N, H, N), ARMS(N, L, N, H), ARMS(H, N, L, N),
+};
+
+#undef N
+#undef L
+#undef H
+#undef D
+
+/* quadrants of U+2596 to U+259F */
+#define Q_UL 0x1
+#define Q_UR 0x2
+#define Q_LL 0x4
+#define Q_LR 0x8
+
+static const uint8_t quadrants[] = {
+	Q_LL, Q_LR, Q_UL, Q_UL | Q_LL | Q_LR, Q_UL | Q_LR,
+	Q_UL | Q_UR | Q_LL, Q_UL | Q_UR | Q_LR, Q_UR, Q_UR | Q_LL,
+	Q_UR | Q_LL | Q_LR,
+};
+
+/* antialiased shapes are sampled on a grid of this many points per pixel
+ * and axis */
+#define SAMPLES 4
+
+struct box {
+	uint8_t *buf;
+	int stride;
+	int width;
+	int height;
+	/* light stroke width; heavy strokes are twice as wide, double lines
+	 * are two light strokes with a light stroke of space in between */
+	int light;
+};
+
+static void box_fill(struct box *b, int x0, int y0, int x1, int y1,
+		     uint8_t alpha)
+{
+	int y;
+
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 > b->width)
+		x1 = b->width;
+	if (y1 > b->height)
+		y1 = b->height;
+	if (x0 >= x1)
+		return;
+
+	for (y = y0; y < y1; ++y)
+		memset(&b->buf[y * b->stride + x0], alpha, x1 - x0);
+}
+
+static int line_size(const struct box *b, int line)
+{
+	switch (line) {
+	case LINE_LIGHT:
+		return b->light;
+	case LINE_HEAVY:
+		return b->light * 2;
+	case LINE_DOUBLE:
+		return b->light * 3;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Where an arm of weight @line meets the center, measured along its own axis
+ * of length @len. @neg and @pos are the crossing arms (up/down for horizontal
+ * arms, left/right for vertical ones). @side selects the stroke of a double
+ * arm: -1 for the one on the side of @neg, 1 for the other; 0 for single
+ * strokes. An arm pointing towards @len starts at @lo, one pointing towards 0
+ * ends at @hi.
+ */
+static void box_joint(const struct box *b, int len, int line, int neg, int pos,
+		      int side, int *lo, int *hi)
+{
+	int t = b->light, d0 = (len - 3 * t) / 2, same, k;
+
+	if (side) {
+		same = side < 0 ? neg : pos;
+		if (same == LINE_DOUBLE) {
+			/* inner corner */
+			*lo = d0 + 2 * t;
+			*hi = d0 + t;
+			return;
+		}
+	} else if (neg == LINE_DOUBLE && pos == LINE_DOUBLE) {
+		/* touch the near stroke of a straight double line only */
+		*lo = d0 + 2 * t;
+		*hi = d0 + t;
+		return;
+	}
+
+	if (neg == LINE_DOUBLE || pos == LINE_DOUBLE) {
+		/* outer corner */
+		*lo = d0;
+		*hi = d0 + 3 * t;
+		return;
+	}
+
+	k = line_size(b, neg);
+	if (line_size(b, pos) > k)
+		k = line_size(b, pos);
+	if (!k)
+		k = side ? t : line_size(b, line);
+
+	*lo = (len - k) / 2;
+	*hi = *lo + k;
+}
+
+/* draw the strokes of one arm, from the cell edge to the center */
+static void box_arm(struct box *b, int arm, int line, int neg, int pos)
+{
+	bool vert = arm == ARM_UP || arm == ARM_DOWN;
+	int len = vert ? b->height : b->width;
+	int across = vert ? b->width : b->height;
+	int t = b->light, lo, hi, from, to, c0, c1, side, i, n;
+
+	n = line == LINE_DOUBLE ? 2 : 1;
+	for (i = 0; i < n; ++i) {
+		if (line == LINE_DOUBLE) {
+			side = i ? 1 : -1;
+			c0 = (across - 3 * t) / 2 + (i ? 2 * t : 0);
+			c1 = c0 + t;
+		} else {
+			side = 0;
+			c0 = (across - line_size(b, line)) / 2;
+			c1 = c0 + line_size(b, line);
+		}
+
+		box_joint(b, len, line, neg, pos, side, &lo, &hi);
+		if (arm == ARM_RIGHT || arm == ARM_DOWN) {
+			from = lo;
+			to = len;
+		} else {
+			from = 0;
+			to = hi;
+		}
+
+		if (vert)
+			box_fill(b, c0, from, c1, to, 0xff);
+		else
+			box_fill(b, from, c0, to, c1, 0xff);
+	}
+}
+
+static void box_lines(struct box *b, uint8_t arms)
+{
+	int up = ARM(arms, ARM_UP), right = ARM(arms, ARM_RIGHT);
+	int down = ARM(arms, ARM_DOWN), left = ARM(arms, ARM_LEFT);
+
+	if (up)
+		box_arm(b, ARM_UP, up, left, right);
+	if (down)
+		box_arm(b, ARM_DOWN, down, left, right);
+	if (left)
+		box_arm(b, ARM_LEFT, left, up, down);
+	if (right)
+		box_arm(b, ARM_RIGHT, right, up, down);
+}
+
+/* @n dashes along a light or heavy line */
+static void box_dashes(struct box *b, bool vert, int line, int n)
+{
+	int len = vert ? b->height : b->width;
+	int across = vert ? b->width : b->height;
+	int k = line_size(b, line), c0 = (across - k) / 2;
+	int i, from, to, gap;
+
+	for (i = 0; i < n; ++i) {
+		from = i * len / n;
+		to = (i + 1) * len / n;
+		gap = (to - from) / 3;
+		if (!gap)
+			gap = 1;
+		from += gap / 2;
+		to -= gap - gap / 2;
+
+		if (vert)
+			box_fill(b, c0, from, c0 + k, to, 0xff);
+		else
+			box_fill(b, from, c0, to, c0 + k, 0xff);
+	}
+}
+
+/* coverage of a shape given by @inside, which tests a point in pixels */
+static void box_sample(struct box *b,
+		       bool (*inside) (const struct box *b, double x, double y,
+				       int arg),
+		       int arg)
+{
+	int x, y, i, j, n;
+
+	for (y = 0; y < b->height; ++y) {
+		for (x = 0; x < b->width; ++x) {
+			n = 0;
+			for (j = 0; j < SAMPLES; ++j)
+				for (i = 0; i < SAMPLES; ++i)
+					n += inside(b,
+						    x + (i + 0.5) / SAMPLES,
+						    y + (j + 0.5) / SAMPLES,
+						    arg);
+			if (n)
+				b->buf[y * b->stride + x] |=
+					n * 255 / (SAMPLES * SAMPLES);
+		}
+	}
+}
+
+/* @arg is the character offset from U+256D: ╭ ╮ ╯ ╰ */
+static bool inside_arc(const struct box *b, double x, double y, int arg)
+{
+	double t = b->light, cx, cy, r, ox, oy, u, v;
+	int sx = arg == 0 || arg == 3 ? 1 : -1;
+	int sy = arg < 2 ? 1 : -1;
+
+	/* centers of the light strokes used by straight arms */
+	cx = (b->width - b->light) / 2 + t / 2;
+	cy = (b->height - b->light) / 2 + t / 2;
+	r = sx > 0 ? b->width - cx : cx;
+	if (sy > 0 && b->height - cy < r)
+		r = b->height - cy;
+	else if (sy < 0 && cy < r)
+		r = cy;
+
+	ox = cx + sx * r;
+	oy = cy + sy * r;
+	u = (x - ox) * sx;
+	v = (y - oy) * sy;
+
+	if (u <= 0 && v <= 0)
+		return fabs(hypot(x - ox, y - oy) - r) <= t / 2;
+	else if (v <= 0)
+		return fabs(y - cy) <= t / 2;
+	else if (u <= 0)
+		return fabs(x - cx) <= t / 2;
+
+	return false;
+}
+
+/* @arg: 1 is ╱, 2 is ╲, 3 both */
+static bool inside_diagonal(const struct box *b, double x, double y, int arg)
+{
+	double w = b->width, h = b->height, t = b->light;
+	double len = hypot(w, h);
+
+	if ((arg & 1) && fabs(h * x + w * y - w * h) / len <= t / 2)
+		return true;
+	if ((arg & 2) && fabs(h * x - w * y) / len <= t / 2)
+		return true;
+
+	return false;
+}
+
+static void box_quadrants(struct box *b, uint8_t q)
+{
+	int mx = b->width / 2, my = b->height / 2;
+
+	if (q & Q_UL)
+		box_fill(b, 0, 0, mx, my, 0xff);
+	if (q & Q_UR)
+		box_fill(b, mx, 0, b->width, my, 0xff);
+	if (q & Q_LL)
+		box_fill(b, 0, my, mx, b->height, 0xff);
+	if (q & Q_LR)
+		box_fill(b, mx, my, b->width, b->height, 0xff);
+}
+
+static void box_block(struct box *b, uint32_t ch)
+{
+	int w = b->width, h = b->height;
+
+	if (ch == 0x2580) {
+		box_fill(b, 0, 0, w, h / 2, 0xff);
+	} else if (ch <= 0x2588) {
+		/* lower eighths */
+		box_fill(b, 0, h - (h * (int)(ch - 0x2580) + 4) / 8, w, h,
+			 0xff);
+	} else if (ch <= 0x258f) {
+		/* left eighths, from 7/8 down to 1/8 */
+		box_fill(b, 0, 0, (w * (int)(0x2590 - ch) + 4) / 8, h, 0xff);
+	} else if (ch == 0x2590) {
+		box_fill(b, w / 2, 0, w, h, 0xff);
+	} else if (ch <= 0x2593) {
+		/* shades; a flat alpha tiles seamlessly */
+		box_fill(b, 0, 0, w, h, 0x40 * (ch - 0x2590));
+	} else if (ch == 0x2594) {
+		box_fill(b, 0, 0, w, (h + 4) / 8, 0xff);
+	} else if (ch == 0x2595) {
+		box_fill(b, w - (w + 4) / 8, 0, w, h, 0xff);
+	} else {
+		box_quadrants(b, quadrants[ch - 0x2596]);
+	}
+}
+
+/*
+ * Dots 1-3 and 7 form the left column, 4-6 and 8 the right one; bit n - 1 of
+ * the offset from U+2800 is dot n.
+ */
+static void box_braille(struct box *b, uint32_t ch)
+{
+	static const uint8_t col[8] = { 0, 0, 0, 1, 1, 1, 0, 1 };
+	static const uint8_t row[8] = { 0, 1, 2, 0, 1, 2, 3, 3 };
+	int w = b->width, h = b->height, size, x, y, i;
+
+	/* dots are squares of half the size of their share of the cell */
+	size = w / 4 < h / 8 ? w / 4 : h / 8;
+	if (size < 1)
+		size = 1;
+
+	for (i = 0; i < 8; ++i) {
+		if (!((ch - 0x2800) & (1 << i)))
+			continue;
+
+		x = (w * (2 * col[i] + 1)) / 4 - size / 2;
+		y = (h * (2 * row[i] + 1)) / 8 - size / 2;
+		box_fill(b, x, y, x + size, y + size, 0xff);
+	}
+}
+
+static bool box_supports(uint32_t ch)
+{
+	return (ch >= 0x2500 && ch <= 0x259f) ||
+	       (ch >= 0x2800 && ch <= 0x28ff);
+}
+
+/*
+ * Generate the glyph for @ch as an A8 mask of @width x @height pixels into
+ * @glyph, which must be zeroed. Returns -ENOENT if @ch is not one of ours;
+ * the caller then has to rasterize it as usual. The buffer is allocated with
+ * malloc().
+ */
+int wlt_boxdraw_render(struct wlt_glyph *glyph, uint32_t ch,
+		       unsigned int width, unsigned int height)
+{
+	struct box b;
+	uint8_t arms;
+
+	if (!box_supports(ch))
+		return -ENOENT;
+	if (!width || !height)
+		return -EINVAL;
+
+	b.width = width;
+	b.height = height;
+	b.stride = cairo_format_stride_for_width(CAIRO_FORMAT_A8, width);
+	b.light = (width < height ? width : height) / 8;
+	if (b.light < 1)
+		b.light = 1;
+
+	b.buf = calloc(1, (size_t)b.stride * height);
+	if (!b.buf)
+		return -ENOMEM;
+
+	if (ch >= 0x2800) {
+		box_braille(&b, ch);
+	} else if (ch >= 0x2580) {
+		box_block(&b, ch);
+	} else if ((arms = box_arms[ch - 0x2500])) {
+		box_lines(&b, arms);
+	} else if (ch >= 0x2504 && ch <= 0x250b) {
+		/* triple and quadruple dashes; light, heavy, horizontal,
+		 * vertical */
+		box_dashes(&b, ch & 0x2, ch & 0x1 ? LINE_HEAVY : LINE_LIGHT,
+			   ch < 0x2508 ? 3 : 4);
+	} else if (ch >= 0x254c && ch <= 0x254f) {
+		box_dashes(&b, ch & 0x2, ch & 0x1 ? LINE_HEAVY : LINE_LIGHT,
+			   2);
+	} else if (ch >= 0x256d && ch <= 0x2570) {
+		box_sample(&b, inside_arc, ch - 0x256d);
+	} else {
+		box_sample(&b, inside_diagonal, ch - 0x2570);
+	}
+
+	glyph->format = WLT_GLYPH_A8;
+	glyph->width = width;
+	glyph->height = height;
+	glyph->stride = b.stride;
+	glyph->buffer = b.buf;
+	return 0;
+}
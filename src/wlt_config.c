@@ -39,7 +39,11 @@
 
 #include <cairo.h>
 #include <errno.h>
+#ifdef WLT_HEADLESS
+#include <glib.h>
+#else
 #include <gtk/gtk.h>
+#endif
 #include <paths.h>
 #include <stdlib.h>
 #include <string.h>
@@ -50,10 +54,22 @@ struct wlt_config {
 
 	gboolean show_dirty;
 	gboolean snap_size;
+	gboolean parallel_render;
+	gboolean async_raster;
+	gboolean pty_thread;
+	gboolean parse_thread;
 	gint sb_size;
+	gint max_fps;
+	gint read_budget;
+	gint glyph_cache_size;
+	gint color_cache_size;
 	gchar *palette;
+	gchar *stats_file;
 	char **argv;
 
+	gboolean server;
+	gboolean client;
+
 	gchar *font_name;
 	gint font_size;
 	gboolean bold;
@@ -271,14 +287,56 @@ static int load_config_file(struct wlt_config *conf, char *fname)
 	if (r < 0)
 		goto error;
 
+	r = load_bool(keyf, "terminal", "parallel_render",
+	              &conf->parallel_render, &err);
+	if (r < 0)
+		goto error;
+
+	r = load_bool(keyf, "terminal", "async_raster", &conf->async_raster,
+	              &err);
+	if (r < 0)
+		goto error;
+
+	r = load_bool(keyf, "terminal", "pty_thread", &conf->pty_thread, &err);
+	if (r < 0)
+		goto error;
+
+	r = load_bool(keyf, "terminal", "parse_thread", &conf->parse_thread,
+	              &err);
+	if (r < 0)
+		goto error;
+
 	r = load_int(keyf, "terminal", "sb_size", &conf->sb_size, &err);
 	if (r < 0)
 		goto error;
 
+	r = load_int(keyf, "terminal", "max_fps", &conf->max_fps, &err);
+	if (r < 0)
+		goto error;
+
+	r = load_int(keyf, "terminal", "read_budget", &conf->read_budget,
+	             &err);
+	if (r < 0)
+		goto error;
+
+	r = load_int(keyf, "terminal", "glyph_cache_size",
+	             &conf->glyph_cache_size, &err);
+	if (r < 0)
+		goto error;
+
+	r = load_int(keyf, "terminal", "color_cache_size",
+	             &conf->color_cache_size, &err);
+	if (r < 0)
+		goto error;
+
 	r = load_str(keyf, "terminal", "palette", &conf->palette, &err);
 	if (r < 0)
 		goto error;
 
+	r = load_str(keyf, "terminal", "stats_file", &conf->stats_file, &err);
+	if (r < 0)
+		goto error;
+
 	r = load_argv(keyf, "terminal", "exec", &conf->argv, &err);
 	if (r < 0)
 		goto error;
@@ -343,11 +401,22 @@ static int init_config(struct wlt_config *config, int *argc, char ***argv)
 
 	char *cfg = NULL;
 	char **targv = NULL;
+	gboolean server = FALSE;
+	gboolean client = FALSE;
 
 	int show_dirty = 2;
 	int snap_size = 2;
+	int parallel_render = 2;
+	int async_raster = 2;
+	int pty_thread = 2;
+	int parse_thread = 2;
 	int sb_size = -1;
+	int max_fps = -1;
+	int read_budget = -1;
+	int glyph_cache_size = -1;
+	int color_cache_size = -1;
 	char *palette = NULL;
+	char *stats_file = NULL;
 
 	char *font_name = NULL;
 	int font_size = 0;
@@ -364,6 +433,10 @@ static int init_config(struct wlt_config *config, int *argc, char ***argv)
 	GOptionEntry opts[] = {
 		{ "config",        'c', G_OPTION_FLAG_NONE,    G_OPTION_ARG_FILENAME, 
 			&cfg,        "Specify the configuration file",             NULL },
+		{ "server",        0,   G_OPTION_FLAG_NONE,    G_OPTION_ARG_NONE, 
+			&server,     "Host windows for --client invocations",      NULL },
+		{ "client",        0,   G_OPTION_FLAG_NONE,    G_OPTION_ARG_NONE, 
+			&client,     "Ask the running server for a new window",    NULL },
 
 		{ "show-dirty",    0,   G_OPTION_FLAG_NONE,    G_OPTION_ARG_NONE, 
 			&show_dirty, "Mark dirty cells during redraw",             NULL },
@@ -373,10 +446,42 @@ static int init_config(struct wlt_config *config, int *argc, char ***argv)
 			&snap_size,  "Snap to next cell-size when resizing",       NULL },
 		{ "no-snap-size",  0,   G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, 
 			&snap_size,  "Don't snap to next cell-size when resizing", NULL },
+		{ "parallel-render", 0, G_OPTION_FLAG_NONE,    G_OPTION_ARG_NONE, 
+			&parallel_render, "Render on all cores",                 NULL },
+		{ "no-parallel-render", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, 
+			&parallel_render, "Render on the main thread only",      NULL },
+		{ "async-raster",  0,   G_OPTION_FLAG_NONE,    G_OPTION_ARG_NONE, 
+			&async_raster, "Rasterize new glyphs in the background",  NULL },
+		{ "no-async-raster", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, 
+			&async_raster, "Rasterize new glyphs while drawing",      NULL },
+		{ "pty-thread",    0,   G_OPTION_FLAG_NONE,    G_OPTION_ARG_NONE, 
+			&pty_thread, "Drain the pty on a separate thread",        NULL },
+		{ "no-pty-thread", 0,   G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, 
+			&pty_thread, "Read the pty on the main thread",           NULL },
+		{ "parse-thread",  0,   G_OPTION_FLAG_NONE,    G_OPTION_ARG_NONE, 
+			&parse_thread, "Parse output on a separate thread; "
+			             "implies --pty-thread",                      NULL },
+		{ "no-parse-thread", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, 
+			&parse_thread, "Parse output on the main thread",         NULL },
 		{ "sb-size",       0,   G_OPTION_FLAG_NONE,    G_OPTION_ARG_INT, 
 			&sb_size,    "Scroll-back buffer size in lines",           NULL },
+		{ "max-fps",       0,   G_OPTION_FLAG_NONE,    G_OPTION_ARG_INT, 
+			&max_fps,    "Limit redraws per second; 0 follows the "
+			             "display",                                   NULL },
+		{ "read-budget",   0,   G_OPTION_FLAG_NONE,    G_OPTION_ARG_INT, 
+			&read_budget, "Microseconds per main-loop iteration spent "
+			             "reading the pty; 0 means a quarter frame",   NULL },
+		{ "glyph-cache-size", 0, G_OPTION_FLAG_NONE,   G_OPTION_ARG_INT, 
+			&glyph_cache_size, "Glyph cache size in KiB; "
+			             "0 means unlimited",                         NULL },
+		{ "color-cache-size", 0, G_OPTION_FLAG_NONE,   G_OPTION_ARG_INT, 
+			&color_cache_size, "Pre-colored glyph cache size in KiB; "
+			             "0 disables it",                             NULL },
 		{ "palette",       'p', G_OPTION_FLAG_NONE,    G_OPTION_ARG_STRING, 
 			&palette,    "Set the terminal's color palette",           NULL },
+		{ "stats-file",    0,   G_OPTION_FLAG_NONE,    G_OPTION_ARG_FILENAME, 
+			&stats_file, "Append statistics to this file on SIGUSR1 "
+			             "instead of stderr",                         NULL },
 
 		{ "font-name",     'f', G_OPTION_FLAG_NONE,    G_OPTION_ARG_STRING, 
 			&font_name,  "Typeface name; defaults to 'monospace'",     NULL },
@@ -418,7 +523,10 @@ static int init_config(struct wlt_config *config, int *argc, char ***argv)
 	g_option_context_set_summary(opt, "wlterm is a libtsm based terminal "
 		"emulator built using GTK+ and friends for rendering.");
 	g_option_context_add_main_entries(opt, opts, NULL);
-	g_option_context_add_group(opt, gtk_get_option_group(TRUE));
+#ifndef WLT_HEADLESS
+	/* the display is opened later; clients never need it */
+	g_option_context_add_group(opt, gtk_get_option_group(FALSE));
+#endif
 	if (!g_option_context_parse(opt, argc, argv, &e)) {
 		g_print("cannot parse arguments: %s\n", e->message);
 		g_error_free(e);
@@ -426,6 +534,9 @@ static int init_config(struct wlt_config *config, int *argc, char ***argv)
 		goto opt_error;
 	}
 
+	config->server = server;
+	config->client = client;
+
 	r = load_config_file(config, cfg);
 	g_free(cfg);
 	if (r < 0)
@@ -492,12 +603,32 @@ static int init_config(struct wlt_config *config, int *argc, char ***argv)
 		config->show_dirty = show_dirty;
 	if (snap_size != 2)
 		config->snap_size = snap_size;
+	if (parallel_render != 2)
+		config->parallel_render = parallel_render;
+	if (async_raster != 2)
+		config->async_raster = async_raster;
+	if (pty_thread != 2)
+		config->pty_thread = pty_thread;
+	if (parse_thread != 2)
+		config->parse_thread = parse_thread;
 	if (sb_size >= 0)
 		config->snap_size = snap_size;
+	if (max_fps >= 0)
+		config->max_fps = max_fps;
+	if (read_budget >= 0)
+		config->read_budget = read_budget;
+	if (glyph_cache_size >= 0)
+		config->glyph_cache_size = glyph_cache_size;
+	if (color_cache_size >= 0)
+		config->color_cache_size = color_cache_size;
 	if (palette != NULL) {
 		g_free(config->palette);
 		config->palette = palette;
 	}
+	if (stats_file != NULL) {
+		g_free(config->stats_file);
+		config->stats_file = stats_file;
+	}
 
 	if (font_name != NULL) {
 		g_free(config->font_name);
@@ -544,15 +675,26 @@ file_error:
 	// after loading one.
 	g_free(config->font_name);
 	g_free(config->palette);
+	g_free(config->stats_file);
 	// We need to free the command line values as they have not yet
 	// been assigned.
 	g_free(font_name);
 	g_free(palette);
+	g_free(stats_file);
 opt_error:
 	g_option_context_free(opt);
 	return r;
 }
 
+static void init_defaults(struct wlt_config *config)
+{
+	config->sb_size = 2000;
+	config->async_raster = TRUE;
+	config->glyph_cache_size = 16384;
+	config->color_cache_size = 4096;
+	config->font_size = 10;
+}
+
 int wlt_config_new(struct wlt_config **out, int *argc, char ***argv)
 {
 	struct wlt_config *config;
@@ -563,9 +705,7 @@ int wlt_config_new(struct wlt_config **out, int *argc, char ***argv)
 		return -ENOMEM;
 	config->ref = 1;
 
-	// Default values
-	config->sb_size = 2000;
-	config->font_size = 10;
+	init_defaults(config);
 
 	r = init_config(config, argc, argv);
 	if (r < 0)
@@ -579,6 +719,25 @@ int wlt_config_new(struct wlt_config **out, int *argc, char ***argv)
 		return r;
 }
 
+// Built-in defaults only; neither config files nor the command line are
+// consulted, so the result is the same on every machine. No command is set.
+int wlt_config_new_default(struct wlt_config **out)
+{
+	struct wlt_config *config;
+
+	config = calloc(1, sizeof(*config));
+	if (!config)
+		return -ENOMEM;
+	config->ref = 1;
+
+	init_defaults(config);
+	config->font_name = g_malloc(sizeof(DEFAULT_FONT));
+	memcpy(config->font_name, DEFAULT_FONT, sizeof(DEFAULT_FONT));
+
+	*out = config;
+	return 0;
+}
+
 void wlt_config_ref(struct wlt_config *config)
 {
 	if (!config || !config->ref)
@@ -594,6 +753,7 @@ void wlt_config_unref(struct wlt_config *config)
 
 	g_free(config->font_name);
 	g_free(config->palette);
+	g_free(config->stats_file);
 	if (config->argv)
 		for (int i = 0; config->argv[i]; ++i) free(config->argv[i]);
 	free(config->argv);
@@ -610,16 +770,71 @@ bool wlt_config_get_snap_size(struct wlt_config *config)
 	return config->snap_size;
 }
 
+bool wlt_config_get_parallel_render(struct wlt_config *config)
+{
+	return config->parallel_render;
+}
+
+bool wlt_config_get_async_raster(struct wlt_config *config)
+{
+	return config->async_raster;
+}
+
+bool wlt_config_get_pty_thread(struct wlt_config *config)
+{
+	return config->pty_thread;
+}
+
+bool wlt_config_get_parse_thread(struct wlt_config *config)
+{
+	return config->parse_thread;
+}
+
 int wlt_config_get_sb_size(struct wlt_config *config)
 {
 	return config->sb_size;
 }
 
+int wlt_config_get_max_fps(struct wlt_config *config)
+{
+	return config->max_fps;
+}
+
+int wlt_config_get_read_budget(struct wlt_config *config)
+{
+	return config->read_budget;
+}
+
+int wlt_config_get_glyph_cache_size(struct wlt_config *config)
+{
+	return config->glyph_cache_size;
+}
+
+int wlt_config_get_color_cache_size(struct wlt_config *config)
+{
+	return config->color_cache_size;
+}
+
 const char *wlt_config_get_palette(struct wlt_config *config)
 {
 	return config->palette;
 }
 
+const char *wlt_config_get_stats_file(struct wlt_config *config)
+{
+	return config->stats_file;
+}
+
+bool wlt_config_get_server(struct wlt_config *config)
+{
+	return config->server;
+}
+
+bool wlt_config_get_client(struct wlt_config *config)
+{
+	return config->client;
+}
+
 char *const *wlt_config_get_argv(struct wlt_config *config)
 {
 	return config->argv;
@@ -0,0 +1,468 @@
+/*
+ * wlterm - persistent glyph cache
+ *
+ * Copyright (c) 2017 Pamelloes <pamelloes@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Persistent Glyph Cache
+ * Measuring a font and rasterizing the common glyphs through pango is the
+ * bulk of our startup time, and every instance used to do it again. This
+ * stores face metrics plus glyph bitmaps in a file below
+ * $XDG_CACHE_HOME/wlterm/. Files are keyed by a string describing the face
+ * (font description, resolution, the font file fontconfig resolves it to,
+ * rendering options and library versions). Glyphs are keyed by their
+ * codepoint sequence, as tsm ids are only valid for a single screen. Files
+ * are written once into a temporary file and renamed into place, so they are
+ * immutable and can be mapped read-only and shared by all instances.
+ *
+ * Layout: header, key string (padded to 8 bytes), sorted entry table,
+ * bitmaps (each aligned to 16 bytes). All values are host-endian; files from
+ * other machines simply fail validation.
+ */
+
+#include <cairo.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "wlterm.h"
+
+#define DISK_MAGIC "WLTGLYPH"
+/* bump this whenever the layout or the output of any glyph generator,
+ * including the built-in ones of wlt_boxdraw.c, changes */
+#define DISK_VERSION 4
+#define DISK_MAX_CH 4
+
+struct disk_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t key_len;
+	uint32_t width;
+	uint32_t height;
+	uint32_t baseline;
+	uint32_t underline_pos;
+	uint32_t underline_size;
+	uint32_t n_entries;
+	uint64_t size;
+};
+
+struct disk_entry {
+	uint32_t ch[DISK_MAX_CH];
+	uint32_t len;
+	uint32_t cwidth;
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint64_t offset;
+};
+
+struct wlt_disk_cache {
+	uint8_t *map;
+	size_t size;
+	const struct disk_header *header;
+	const struct disk_entry *entries;
+};
+
+static size_t align_to(size_t v, size_t a)
+{
+	return (v + a - 1) & ~(a - 1);
+}
+
+static char *disk_path(const char *key)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	const char *k;
+
+	for (k = key; *k; ++k)
+		h = (h ^ (uint8_t)*k) * 0x100000001b3ULL;
+
+	return g_strdup_printf("%s/wlterm/%016llx.glyphs",
+			       g_get_user_cache_dir(), (unsigned long long)h);
+}
+
+static int entry_cmp(const uint32_t *ch, size_t len, size_t cwidth,
+		     const struct disk_entry *e)
+{
+	size_t i;
+
+	if (len != e->len)
+		return len < e->len ? -1 : 1;
+	for (i = 0; i < len; ++i)
+		if (ch[i] != e->ch[i])
+			return ch[i] < e->ch[i] ? -1 : 1;
+	if (cwidth != e->cwidth)
+		return cwidth < e->cwidth ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Bitmaps are handed to cairo and the blend kernels as they are, so an entry
+ * is only accepted if it is exactly what create_glyph() would have produced
+ * for the face: an A8 mask of the cell size with cairo's stride, placed
+ * entirely inside the bitmap area behind the entry table.
+ */
+static bool valid_entry(const struct disk_header *h,
+			const struct disk_entry *e, size_t payload, size_t size)
+{
+	if (!e->len || e->len > DISK_MAX_CH || !e->cwidth)
+		return false;
+	if (e->format != WLT_GLYPH_A8 ||
+	    e->width != (uint64_t)h->width * e->cwidth ||
+	    e->height != h->height ||
+	    e->stride != (uint32_t)cairo_format_stride_for_width(
+						CAIRO_FORMAT_A8, e->width))
+		return false;
+	if (e->offset < payload || e->offset > size || e->offset % 16 ||
+	    (uint64_t)e->stride * e->height > size - e->offset)
+		return false;
+
+	return true;
+}
+
+static int validate(struct wlt_disk_cache *cache, const char *key)
+{
+	const struct disk_header *h;
+	const struct disk_entry *e;
+	size_t key_len, off, i;
+
+	if (cache->size < sizeof(*h))
+		return -EINVAL;
+
+	h = (const void*)cache->map;
+	key_len = strlen(key);
+	if (memcmp(h->magic, DISK_MAGIC, sizeof(h->magic)) ||
+	    h->version != DISK_VERSION || h->size != cache->size ||
+	    h->key_len != key_len || !h->width || !h->height)
+		return -EINVAL;
+
+	off = sizeof(*h);
+	if (off + key_len > cache->size ||
+	    memcmp(&cache->map[off], key, key_len))
+		return -EINVAL;
+
+	off = align_to(off + key_len, 8);
+	if (h->n_entries > (cache->size - off) / sizeof(*e))
+		return -EINVAL;
+
+	cache->header = h;
+	cache->entries = (const void*)&cache->map[off];
+
+	off += h->n_entries * sizeof(*e);
+	for (i = 0; i < h->n_entries; ++i) {
+		e = &cache->entries[i];
+		if (!valid_entry(h, e, off, cache->size))
+			return -EINVAL;
+		if (i && entry_cmp(cache->entries[i - 1].ch,
+				   cache->entries[i - 1].len,
+				   cache->entries[i - 1].cwidth, e) >= 0)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+int wlt_disk_cache_open(struct wlt_disk_cache **out, const char *key)
+{
+	struct wlt_disk_cache *cache;
+	struct stat st;
+	char *path;
+	void *map;
+	int fd, r;
+
+	path = disk_path(key);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	g_free(path);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		r = -errno;
+		goto err_fd;
+	}
+	if (st.st_size <= 0) {
+		r = -EINVAL;
+		goto err_fd;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		r = -errno;
+		goto err_fd;
+	}
+	close(fd);
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache) {
+		r = -ENOMEM;
+		goto err_map;
+	}
+	cache->map = map;
+	cache->size = st.st_size;
+
+	r = validate(cache, key);
+	if (r < 0)
+		goto err_cache;
+
+	*out = cache;
+	return 0;
+
+err_cache:
+	free(cache);
+err_map:
+	munmap(map, st.st_size);
+	return r;
+
+err_fd:
+	close(fd);
+	return r;
+}
+
+void wlt_disk_cache_close(struct wlt_disk_cache *cache)
+{
+	if (!cache)
+		return;
+
+	munmap(cache->map, cache->size);
+	free(cache);
+}
+
+void wlt_disk_cache_get_metrics(struct wlt_disk_cache *cache,
+				struct wlt_face_metrics *out)
+{
+	const struct disk_header *h = cache->header;
+
+	out->width = h->width;
+	out->height = h->height;
+	out->baseline = h->baseline;
+	out->underline_pos = h->underline_pos;
+	out->underline_size = h->underline_size;
+}
+
+/*
+ * Look up the glyph for @ch. On success, @glyph describes a bitmap inside the
+ * mapping; it stays valid until the cache is closed and must not be written
+ * to. @glyph->id is left untouched.
+ */
+int wlt_disk_cache_lookup(struct wlt_disk_cache *cache,
+			  struct wlt_glyph *glyph,
+			  const uint32_t *ch, size_t len, size_t cwidth)
+{
+	const struct disk_entry *e;
+	size_t l, r, m;
+	int c;
+
+	if (!len || len > DISK_MAX_CH)
+		return -ENOENT;
+
+	l = 0;
+	r = cache->header->n_entries;
+	while (l < r) {
+		m = l + (r - l) / 2;
+		e = &cache->entries[m];
+
+		c = entry_cmp(ch, len, cwidth, e);
+		if (!c) {
+			glyph->cwidth = e->cwidth;
+			glyph->format = e->format;
+			glyph->width = e->width;
+			glyph->stride = e->stride;
+			glyph->height = e->height;
+			glyph->buffer = &cache->map[e->offset];
+			glyph->cr_surface = NULL;
+			return 0;
+		} else if (c < 0) {
+			r = m;
+		} else {
+			l = m + 1;
+		}
+	}
+
+	return -ENOENT;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	ssize_t l;
+
+	while (len) {
+		l = write(fd, p, len);
+		if (l < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		p += l;
+		len -= l;
+	}
+
+	return 0;
+}
+
+static int disk_glyph_cmp(const void *a, const void *b)
+{
+	const struct wlt_disk_glyph *x = a, *y = b;
+	struct disk_entry e;
+
+	memset(&e, 0, sizeof(e));
+	memcpy(e.ch, y->ch, y->len * sizeof(*y->ch));
+	e.len = y->len;
+	e.cwidth = y->glyph->cwidth;
+
+	return entry_cmp(x->ch, x->len, x->glyph->cwidth, &e);
+}
+
+/*
+ * Write a new cache file for @key. Glyphs with sequences longer than we
+ * support and duplicates are skipped; @glyphs is sorted in place. The file is
+ * written to a temporary name and renamed, so readers never see partial data.
+ */
+int wlt_disk_cache_write(const char *key, const struct wlt_face_metrics *m,
+			 struct wlt_disk_glyph *glyphs, size_t n)
+{
+	static const uint8_t pad[16];
+	struct disk_header h;
+	struct disk_entry *entries, *e;
+	const struct wlt_glyph **src;
+	const struct wlt_glyph *g;
+	size_t i, cnt, key_len, off, len;
+	char *path, *dir, *tmp;
+	int fd, r;
+
+	qsort(glyphs, n, sizeof(*glyphs), disk_glyph_cmp);
+
+	entries = calloc(n ? n : 1, sizeof(*entries));
+	src = calloc(n ? n : 1, sizeof(*src));
+	if (!entries || !src) {
+		r = -ENOMEM;
+		goto err_entries;
+	}
+
+	key_len = strlen(key);
+
+	/* assign bitmap offsets behind the entry table */
+	cnt = 0;
+	for (i = 0; i < n; ++i) {
+		g = glyphs[i].glyph;
+		if (!glyphs[i].len || glyphs[i].len > DISK_MAX_CH ||
+		    g->stride < 0 || (unsigned int)g->stride < g->width)
+			continue;
+		if (cnt && !disk_glyph_cmp(&glyphs[i - 1], &glyphs[i]))
+			continue;
+
+		e = &entries[cnt];
+		memcpy(e->ch, glyphs[i].ch, glyphs[i].len * sizeof(*e->ch));
+		e->len = glyphs[i].len;
+		e->cwidth = g->cwidth;
+		e->format = g->format;
+		e->width = g->width;
+		e->height = g->height;
+		e->stride = g->stride;
+		src[cnt++] = g;
+	}
+
+	off = align_to(sizeof(h) + key_len, 8) + cnt * sizeof(*entries);
+	for (i = 0; i < cnt; ++i) {
+		off = align_to(off, 16);
+		entries[i].offset = off;
+		off += (size_t)entries[i].stride * entries[i].height;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, DISK_MAGIC, sizeof(h.magic));
+	h.version = DISK_VERSION;
+	h.key_len = key_len;
+	h.width = m->width;
+	h.height = m->height;
+	h.baseline = m->baseline;
+	h.underline_pos = m->underline_pos;
+	h.underline_size = m->underline_size;
+	h.n_entries = cnt;
+	h.size = off;
+
+	path = disk_path(key);
+	dir = g_path_get_dirname(path);
+	tmp = g_strdup_printf("%s.XXXXXX", path);
+
+	if (g_mkdir_with_parents(dir, 0700) < 0) {
+		r = -errno;
+		goto err_path;
+	}
+
+	fd = g_mkstemp(tmp);
+	if (fd < 0) {
+		r = -errno;
+		goto err_path;
+	}
+
+	r = write_all(fd, &h, sizeof(h));
+	if (r >= 0)
+		r = write_all(fd, key, key_len);
+	off = sizeof(h) + key_len;
+	if (r >= 0) {
+		len = align_to(off, 8) - off;
+		r = write_all(fd, pad, len);
+		off += len;
+	}
+	if (r >= 0) {
+		r = write_all(fd, entries, cnt * sizeof(*entries));
+		off += cnt * sizeof(*entries);
+	}
+	for (i = 0; r >= 0 && i < cnt; ++i) {
+		len = entries[i].offset - off;
+		r = write_all(fd, pad, len);
+		if (r >= 0)
+			r = write_all(fd, src[i]->buffer,
+				      (size_t)entries[i].stride *
+				      entries[i].height);
+		off = entries[i].offset +
+		      (size_t)entries[i].stride * entries[i].height;
+	}
+
+	if (close(fd) < 0 && r >= 0)
+		r = -errno;
+	if (r >= 0 && rename(tmp, path) < 0)
+		r = -errno;
+	if (r < 0)
+		unlink(tmp);
+
+err_path:
+	g_free(tmp);
+	g_free(dir);
+	g_free(path);
+err_entries:
+	free(src);
+	free(entries);
+	return r < 0 ? r : 0;
+}
@@ -33,6 +33,7 @@
 
 #include <cairo.h>
 #include <errno.h>
+#include <fontconfig/fontconfig.h>
 #include <glib.h>
 #include <pango/pango.h>
 #include <pango/pangocairo.h>
@@ -40,58 +41,212 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "wlterm.h"
+#include "shl_dlist.h"
 #include "shl_htable.h"
 
+/* keys below this are looked up directly; see face_lookup() */
+#define WLT_FACE_DIRECT 256
+
+/* first glyph key of combining sequences; see wlt_face_get_key() */
+#define WLT_FONT_SEQUENCE_BASE 0x80000000UL
+
 struct wlt_font {
 	unsigned long ref;
 	PangoFontMap *map;
+	/* faces use the persistent glyph cache */
+	bool disk_cache;
+
+	unsigned long frame;
+
+	/* glyph keys of combining sequences */
+	struct shl_htable sequences;
+	unsigned long next_sequence;
+
+	/* glyphs of all faces, most recently used first */
+	struct shl_dlist glyphs;
+	size_t glyphs_size;
+	size_t glyphs_max;
+	struct wlt_cache_stats glyph_stats;
+
+	/* pre-colored glyphs of all faces, most recently used first */
+	struct shl_dlist colored;
+	size_t colored_size;
+	size_t colored_max;
+	struct wlt_cache_stats colored_stats;
+
+	/* asynchronous rasterization */
+	struct wlt_pool *raster;
+	GMutex raster_lock;
+	struct shl_dlist raster_done;
+	guint raster_src;
+	wlt_font_cb raster_cb;
+	void *raster_data;
 };
 
 struct wlt_face {
 	unsigned long ref;
 	struct wlt_font *font;
+	PangoFontDescription *desc;
 	PangoContext *ctx;
+	PangoContext **worker_ctx;
+	unsigned int n_worker_ctx;
+	struct wlt_disk_cache *disk;
 
+	struct wlt_cached **direct;
 	struct shl_htable glyphs;
-	unsigned int width;
-	unsigned int height;
-	unsigned int baseline;
-	bool underline;
+	struct shl_htable colored;
+	struct wlt_cache_stats stats;
+	struct wlt_face_metrics metrics;
+
+	/* see wlt_face_new_lazy() */
+	bool loaded;
+	int error;
+};
+
+struct wlt_cached {
+	struct wlt_glyph glyph;
+	struct wlt_face *face;
+	struct shl_dlist list;
+	unsigned long frame;
+	size_t size;
+	/* key entry of a combining sequence, NULL for single codepoints */
+	struct wlt_sequence *seq;
+	bool builtin;
+	bool mapped;
+	bool pending;
+	int error;
+};
+
+struct wlt_raster_job {
+	struct shl_dlist list;
+	struct wlt_face *face;
+	struct wlt_cached *c;
+	int error;
+	size_t len;
+	uint32_t ch[];
+};
+
+struct wlt_colored {
+	struct wlt_color_glyph cglyph;
+	struct wlt_face *face;
+	struct shl_dlist list;
+	unsigned long frame;
+	size_t size;
+};
+
+struct wlt_sequence {
+	unsigned long key;
+	/* cached glyphs using the key */
+	unsigned long ref;
+	size_t len;
+	const uint32_t *ch;
 };
 
 #define wlt_to_glyph(_id) \
 	shl_htable_offsetof((_id), struct wlt_glyph, id)
+#define wlt_to_cached(_glyph) \
+	shl_htable_offsetof((_glyph), struct wlt_cached, glyph)
+#define wlt_to_colored(_cg) \
+	shl_htable_offsetof((_cg), struct wlt_colored, cglyph)
 
 static void wlt_glyph_free(struct wlt_glyph *glyph);
 
+static size_t hash_sequence(const uint32_t *ch, size_t len)
+{
+	size_t i, h = len;
+
+	for (i = 0; i < len; ++i)
+		h = h * 31 + ch[i];
+	return h;
+}
+
+static bool compare_sequence(const void *a, const void *b)
+{
+	const struct wlt_sequence *x = a, *y = b;
+
+	return x->len == y->len &&
+	       !memcmp(x->ch, y->ch, x->len * sizeof(*x->ch));
+}
+
+static size_t rehash_sequence(const void *elem, void *priv)
+{
+	const struct wlt_sequence *s = elem;
+
+	return hash_sequence(s->ch, s->len);
+}
+
+static void free_sequence(void *elem, void *ctx)
+{
+	free(elem);
+}
+
+static struct wlt_sequence *wlt_font_find_sequence(struct wlt_font *font,
+						   const uint32_t *ch,
+						   size_t len)
+{
+	struct wlt_sequence key, *s;
+
+	key.len = len;
+	key.ch = ch;
+	if (!shl_htable_lookup(&font->sequences, &key, hash_sequence(ch, len),
+			       (void**)&s))
+		return NULL;
+
+	return s;
+}
+
+/* drop @s unless a cached glyph still uses its key */
+static void wlt_font_put_sequence(struct wlt_font *font,
+				  struct wlt_sequence *s)
+{
+	struct wlt_sequence *tmp;
+
+	if (!s || s->ref)
+		return;
+
+	shl_htable_remove(&font->sequences, s, rehash_sequence(s, NULL),
+			  (void**)&tmp);
+	free_sequence(s, NULL);
+}
+static void wlt_face_prewarm(struct wlt_face *face);
+
 int wlt_font_new(struct wlt_font **out)
 {
 	struct wlt_font *font;
-	int r;
 
 	font = calloc(1, sizeof(*font));
 	if (!font)
 		return -ENOMEM;
 	font->ref = 1;
+	font->disk_cache = true;
+	font->next_sequence = WLT_FONT_SEQUENCE_BASE;
+	shl_htable_init(&font->sequences, compare_sequence, rehash_sequence,
+			NULL);
+	shl_dlist_init(&font->glyphs);
+	shl_dlist_init(&font->colored);
+	shl_dlist_init(&font->raster_done);
+	g_mutex_init(&font->raster_lock);
+
+	*out = font;
+	return 0;
+}
+
+/* The font map is mostly needed to rasterize glyphs. Setting it up is not
+ * free, so defer it until a face misses the persistent cache. */
+static PangoFontMap *wlt_font_get_map(struct wlt_font *font)
+{
+	if (font->map)
+		return font->map;
 
 	font->map = pango_cairo_font_map_get_default();
-	if (font->map) {
+	if (font->map)
 		g_object_ref(font->map);
-	} else {
+	else
 		font->map = pango_cairo_font_map_new();
-		if (!font->map) {
-			r = -ENOMEM;
-			goto err_free;
-		}
-	}
 
-	*out = font;
-	return 0;
-
-err_free:
-	free(font);
-	return r;
+	return font->map;
 }
 
 void wlt_font_ref(struct wlt_font *font)
@@ -107,10 +262,37 @@ void wlt_font_unref(struct wlt_font *font)
 	if (!font || !font->ref || --font->ref)
 		return;
 
-	g_object_unref(font->map);
+	wlt_font_set_raster_threads(font, 0, NULL, NULL);
+	g_mutex_clear(&font->raster_lock);
+	shl_htable_clear(&font->sequences, free_sequence, NULL);
+	if (font->map)
+		g_object_unref(font->map);
 	free(font);
 }
 
+/* begin a new frame; cache entries used in a frame are never evicted before
+ * the next one starts */
+void wlt_font_next_frame(struct wlt_font *font)
+{
+	++font->frame;
+}
+
+void wlt_font_get_glyph_stats(struct wlt_font *font,
+			      struct wlt_cache_stats *out)
+{
+	*out = font->glyph_stats;
+	out->size = font->glyphs_size;
+	out->max_size = font->glyphs_max;
+}
+
+void wlt_font_get_color_stats(struct wlt_font *font,
+			      struct wlt_cache_stats *out)
+{
+	*out = font->colored_stats;
+	out->size = font->colored_size;
+	out->max_size = font->colored_max;
+}
+
 static void init_pango_desc(PangoFontDescription *desc, int desc_size,
 			    int desc_bold, int desc_italic)
 {
@@ -149,6 +331,32 @@ static void init_pango_desc(PangoFontDescription *desc, int desc_size,
 		pango_font_description_set_size(desc, 10 * PANGO_SCALE);
 }
 
+/*
+ * Pango gives line positions as the distance of the top of the line above the
+ * baseline. Convert that into an offset from the top of the cell and make
+ * sure the line is visible and stays inside the cell.
+ */
+static void measure_line(const struct wlt_face_metrics *m, int pos, int size,
+			 unsigned int *out_pos, unsigned int *out_size)
+{
+	int p, s, h = m->height;
+
+	s = PANGO_PIXELS(size);
+	if (s < 1)
+		s = 1;
+	if (s > h)
+		s = h;
+
+	p = (int)m->baseline - PANGO_PIXELS(pos);
+	if (p > h - s)
+		p = h - s;
+	if (p < 0)
+		p = 0;
+
+	*out_pos = p;
+	*out_size = s;
+}
+
 /*
  * There is no way to check whether a font is a monospace font. Moreover, there
  * is no "monospace extents" field of fonts that we can use to calculate a
@@ -164,9 +372,9 @@ static void measure_pango(struct wlt_face *face)
 				  "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
 				  "@!\"$%&/()=?\\}][{°^~+*#'<>|-_.:,;`´";
 	static const size_t str_len = sizeof(str) - 1;
+	struct wlt_face_metrics *m = &face->metrics;
+	PangoFontMetrics *metrics;
 	PangoLayout *layout;
-	PangoAttrList *attrl;
-	PangoAttribute *uline;
 	PangoRectangle rec;
 
 	layout = pango_layout_new(face->ctx);
@@ -175,80 +383,346 @@ static void measure_pango(struct wlt_face *face)
 	pango_layout_set_spacing(layout, 0);
 	pango_layout_set_text(layout, str, str_len);
 
-	if (face->underline) {
-		attrl = pango_attr_list_new();
-		uline = pango_attr_underline_new(PANGO_UNDERLINE_SINGLE);
-		pango_attr_list_insert(attrl, uline);
-		pango_layout_set_attributes(layout, attrl);
-		pango_attr_list_unref(attrl);
-	}
-
 	pango_layout_get_pixel_extents(layout, NULL, &rec);
 
 	/* We use an example layout to render a bunch of ASCII characters in a
 	 * single line. The height and baseline of the resulting extents can be
 	 * copied unchanged into the face. For the width we calculate the
 	 * average (rounding up). */
-	face->width = (rec.width + (str_len - 1)) / str_len;
-	face->height = rec.height;
-	face->baseline = PANGO_PIXELS_CEIL(pango_layout_get_baseline(layout));
+	m->width = (rec.width + (str_len - 1)) / str_len;
+	m->height = rec.height;
+	m->baseline = PANGO_PIXELS_CEIL(pango_layout_get_baseline(layout));
 
 	g_object_unref(layout);
+
+	/* The underline is drawn by the renderer, so all attribute
+	 * combinations share the plain glyphs. */
+	metrics = pango_context_get_metrics(face->ctx, face->desc, NULL);
+	measure_line(m, pango_font_metrics_get_underline_position(metrics),
+		     pango_font_metrics_get_underline_thickness(metrics),
+		     &m->underline_pos, &m->underline_size);
+	pango_font_metrics_unref(metrics);
 }
 
-static int init_pango(struct wlt_face *face, const char *desc_str,
-		      int desc_size, int desc_bold, int desc_italic)
+static PangoContext *create_context(struct wlt_face *face, PangoFontMap *map)
 {
-	PangoFontDescription *desc;
+	PangoContext *ctx;
+
+	ctx = pango_font_map_create_context(map);
+	if (!ctx)
+		return NULL;
 
 	/* set context options */
-	pango_context_set_base_dir(face->ctx, PANGO_DIRECTION_LTR);
-	pango_context_set_language(face->ctx, pango_language_get_default());
+	pango_context_set_base_dir(ctx, PANGO_DIRECTION_LTR);
+	pango_context_set_language(ctx, pango_language_get_default());
 
 	/* set font description */
-	desc = pango_font_description_from_string(desc_str);
-	init_pango_desc(desc, desc_size, desc_bold, desc_italic);
-	pango_context_set_font_description(face->ctx, desc);
-	pango_font_description_free(desc);
+	pango_context_set_font_description(ctx, face->desc);
 
-	/* measure font */
-	measure_pango(face);
+	return ctx;
+}
 
-	if (!face->width || !face->height)
-		return -EINVAL;
+static int init_pango(struct wlt_face *face)
+{
+	PangoFontMap *map;
+
+	if (face->ctx)
+		return 0;
+
+	map = wlt_font_get_map(face->font);
+	if (!map)
+		return -ENOMEM;
+
+	face->ctx = create_context(face, map);
+	if (!face->ctx)
+		return -ENOMEM;
 
 	return 0;
 }
 
-int wlt_face_new(struct wlt_face **out, struct wlt_font *font,
-		 const char *desc_str, int desc_size, int attrs)
+static int create_glyph(struct wlt_face *face, PangoContext *ctx,
+			struct wlt_glyph *glyph, const uint32_t *ch, size_t len);
+
+/*
+ * Append the font that fontconfig resolves @face to, the same way pango does:
+ * its file, index, size and mtime, plus the rendering options that the
+ * configuration sets for it. Installing, updating or re-aliasing a font, or
+ * changing hinting or antialiasing, thus yields a different key.
+ */
+static void face_key_match(struct wlt_face *face, GString *key, double dpi)
 {
-	struct wlt_face *face;
+	const PangoFontDescription *desc = face->desc;
+	FcPattern *pat, *match;
+	FcResult res;
+	FcChar8 *file = NULL;
+	FcBool aa = FcTrue, hinting = FcTrue, autohint = FcFalse;
+	FcBool embolden = FcFalse;
+	int index = 0, hintstyle = -1, rgba = -1, lcdfilter = -1, slant;
+	struct stat st;
+	char **families;
+	double size;
+	size_t i;
+
+	pat = FcPatternCreate();
+	if (!pat)
+		return;
+
+	families = g_strsplit(pango_font_description_get_family(desc), ",",
+			      -1);
+	for (i = 0; families[i]; ++i)
+		FcPatternAddString(pat, FC_FAMILY,
+				   (const FcChar8*)g_strstrip(families[i]));
+	g_strfreev(families);
+
+	size = (double)pango_font_description_get_size(desc) / PANGO_SCALE;
+	if (!pango_font_description_get_size_is_absolute(desc))
+		size = size * dpi / 72.0;
+	FcPatternAddDouble(pat, FC_PIXEL_SIZE, size);
+
+	FcPatternAddInteger(pat, FC_WEIGHT, FcWeightFromOpenType(
+			pango_font_description_get_weight(desc)));
+
+	switch (pango_font_description_get_style(desc)) {
+	case PANGO_STYLE_ITALIC:
+		slant = FC_SLANT_ITALIC;
+		break;
+	case PANGO_STYLE_OBLIQUE:
+		slant = FC_SLANT_OBLIQUE;
+		break;
+	default:
+		slant = FC_SLANT_ROMAN;
+		break;
+	}
+	FcPatternAddInteger(pat, FC_SLANT, slant);
+
+	FcConfigSubstitute(NULL, pat, FcMatchPattern);
+	FcDefaultSubstitute(pat);
+	match = FcFontMatch(NULL, pat, &res);
+	FcPatternDestroy(pat);
+	if (!match) {
+		g_string_append(key, "|nomatch");
+		return;
+	}
+
+	FcPatternGetString(match, FC_FILE, 0, &file);
+	FcPatternGetInteger(match, FC_INDEX, 0, &index);
+	FcPatternGetBool(match, FC_ANTIALIAS, 0, &aa);
+	FcPatternGetBool(match, FC_HINTING, 0, &hinting);
+	FcPatternGetInteger(match, FC_HINT_STYLE, 0, &hintstyle);
+	FcPatternGetBool(match, FC_AUTOHINT, 0, &autohint);
+	FcPatternGetInteger(match, FC_RGBA, 0, &rgba);
+	FcPatternGetInteger(match, FC_LCD_FILTER, 0, &lcdfilter);
+	FcPatternGetBool(match, FC_EMBOLDEN, 0, &embolden);
+
+	g_string_append_printf(key, "|%s:%d", file ? (const char*)file : "",
+			       index);
+	if (file && !stat((const char*)file, &st))
+		g_string_append_printf(key, "@%lld.%09ld+%lld",
+				       (long long)st.st_mtim.tv_sec,
+				       (long)st.st_mtim.tv_nsec,
+				       (long long)st.st_size);
+	g_string_append_printf(key, "|aa=%d,hint=%d/%d,auto=%d,rgba=%d,lcd=%d,"
+			       "embolden=%d", aa, hinting, hintstyle, autohint,
+			       rgba, lcdfilter, embolden);
+
+	FcPatternDestroy(match);
+}
+
+/* identifies everything that influences metrics and bitmaps of a face */
+static char *face_cache_key(struct wlt_face *face)
+{
+	PangoFontMap *map;
+	GString *key;
+	double dpi = 96.0;
+	char *desc;
+
+	/* only point sizes depend on the resolution of the font map */
+	if (!pango_font_description_get_size_is_absolute(face->desc)) {
+		map = wlt_font_get_map(face->font);
+		if (map)
+			dpi = pango_cairo_font_map_get_resolution(
+						PANGO_CAIRO_FONT_MAP(map));
+	}
+
+	desc = pango_font_description_to_string(face->desc);
+	key = g_string_new(desc);
+	g_free(desc);
+
+	g_string_append_printf(key, "|pango=%d|fc=%d|dpi=%g", pango_version(),
+			       FcGetVersion(), dpi);
+	face_key_match(face, key, dpi);
+
+	return g_string_free(key, FALSE);
+}
+
+/*
+ * Rasterize printable ASCII and store it together with the metrics in the
+ * persistent cache, then map the result. Failing to do so is not fatal; the
+ * face then simply rasterizes everything on demand.
+ */
+static void face_write_cache(struct wlt_face *face, const char *key)
+{
+	struct wlt_glyph glyphs[0x7f - 0x20];
+	struct wlt_disk_glyph entries[0x7f - 0x20];
+	uint32_t chars[0x7f - 0x20];
+	size_t i, n = 0;
 	int r;
 
+	memset(glyphs, 0, sizeof(glyphs));
+	for (i = 0; i < sizeof(chars) / sizeof(*chars); ++i) {
+		chars[i] = 0x20 + i;
+		glyphs[i].cwidth = 1;
+		if (create_glyph(face, face->ctx, &glyphs[i], &chars[i], 1) < 0)
+			continue;
+
+		entries[n].ch = &chars[i];
+		entries[n].len = 1;
+		entries[n].glyph = &glyphs[i];
+		++n;
+	}
+
+	r = wlt_disk_cache_write(key, &face->metrics, entries, n);
+	if (r >= 0)
+		wlt_disk_cache_open(&face->disk, key);
+
+	for (i = 0; i < sizeof(glyphs) / sizeof(*glyphs); ++i) {
+		if (!glyphs[i].cr_surface)
+			continue;
+		cairo_surface_destroy(glyphs[i].cr_surface);
+		free(glyphs[i].buffer);
+	}
+}
+
+static bool compare_colored(const void *a, const void *b)
+{
+	const struct wlt_color_glyph *x = a, *y = b;
+
+	return x->id == y->id && x->fc == y->fc && x->bc == y->bc;
+}
+
+static size_t hash_colored(unsigned long id, uint32_t fc, uint32_t bc)
+{
+	size_t h = id;
+
+	h = h * 31 + fc;
+	h = h * 31 + bc;
+	return h;
+}
+
+static size_t rehash_colored(const void *elem, void *priv)
+{
+	const struct wlt_color_glyph *cg = elem;
+
+	return hash_colored(cg->id, cg->fc, cg->bc);
+}
+
+/*
+ * Measure the face and set up its glyph sources. This is the expensive part
+ * of a face, so lazy faces only do it on first use. The result is remembered;
+ * a face that failed to load keeps failing.
+ */
+static int face_load(struct wlt_face *face)
+{
+	char *key = NULL;
+	int r = -ENOENT;
+
+	if (face->loaded)
+		return face->error;
+	face->loaded = true;
+
+	/* On a warm start, metrics and common glyphs come from the persistent
+	 * cache and pango is only set up once we actually miss. */
+	if (face->font->disk_cache) {
+		key = face_cache_key(face);
+		r = wlt_disk_cache_open(&face->disk, key);
+	}
+
+	if (r >= 0) {
+		wlt_disk_cache_get_metrics(face->disk, &face->metrics);
+	} else {
+		r = init_pango(face);
+		if (r < 0)
+			goto error;
+
+		/* measure font */
+		measure_pango(face);
+		if (!face->metrics.width || !face->metrics.height) {
+			r = -EINVAL;
+			goto error;
+		}
+
+		if (key)
+			face_write_cache(face, key);
+	}
+	g_free(key);
+
+	if (face->font->raster)
+		wlt_face_prewarm(face);
+
+	return 0;
+
+error:
+	g_free(key);
+	face->error = r;
+	return r;
+}
+
+/*
+ * Create a face without loading it. Only the font description is set up;
+ * measuring and everything else happens the first time a glyph or the
+ * metrics are asked for. Most attribute combinations are never used, so this
+ * keeps them off the startup path. Errors show up as failing glyphs then.
+ */
+int wlt_face_new_lazy(struct wlt_face **out, struct wlt_font *font,
+		      const char *desc_str, int desc_size, int attrs)
+{
+	struct wlt_face *face;
+
 	face = calloc(1, sizeof(*face));
 	if (!face)
 		return -ENOMEM;
 	face->ref = 1;
 	face->font = font;
 
+	/* a whole number of cache lines */
+	if (posix_memalign((void**)&face->direct, 64,
+			   WLT_FACE_DIRECT * sizeof(*face->direct))) {
+		free(face);
+		return -ENOMEM;
+	}
+	memset(face->direct, 0, WLT_FACE_DIRECT * sizeof(*face->direct));
+
 	shl_htable_init_ulong(&face->glyphs);
-	face->ctx = pango_font_map_create_context(font->map);
+	shl_htable_init(&face->colored, compare_colored, rehash_colored, NULL);
 
-	face->underline = attrs & WLT_FACE_UNDERLINE;
-	r = init_pango(face, desc_str, desc_size, attrs & WLT_FACE_BOLD, 
-	               attrs & WLT_FACE_ITALICS);
-	if (r < 0)
-		goto err_ctx;
+	face->desc = pango_font_description_from_string(desc_str);
+	init_pango_desc(face->desc, desc_size, attrs & WLT_FACE_BOLD,
+			attrs & WLT_FACE_ITALICS);
 
 	wlt_font_ref(face->font);
+
 	*out = face;
 	return 0;
+}
 
-err_ctx:
-	g_object_unref(face->ctx);
-	free(face);
-	return r;
+int wlt_face_new(struct wlt_face **out, struct wlt_font *font,
+		 const char *desc_str, int desc_size, int attrs)
+{
+	struct wlt_face *face;
+	int r;
+
+	r = wlt_face_new_lazy(&face, font, desc_str, desc_size, attrs);
+	if (r < 0)
+		return r;
+
+	r = face_load(face);
+	if (r < 0) {
+		wlt_face_unref(face);
+		return r;
+	}
+
+	*out = face;
+	return 0;
 }
 
 void wlt_face_ref(struct wlt_face *face)
@@ -264,25 +738,65 @@ static void free_glyph(unsigned long *elem, void *ctx)
 	wlt_glyph_free(wlt_to_glyph(elem));
 }
 
+static void free_colored(void *elem, void *ctx)
+{
+	struct wlt_colored *c = wlt_to_colored((struct wlt_color_glyph*)elem);
+
+	shl_dlist_unlink(&c->list);
+	c->face->font->colored_size -= c->size;
+	free(c->cglyph.buffer);
+	free(c);
+}
+
 void wlt_face_unref(struct wlt_face *face)
 {
+	unsigned int i;
+
 	if (!face || !face->ref || --face->ref)
 		return;
 
-	g_object_unref(face->ctx);
+	shl_htable_clear(&face->colored, free_colored, NULL);
 	shl_htable_clear_ulong(&face->glyphs, free_glyph, NULL);
+	for (i = 0; i < WLT_FACE_DIRECT; ++i)
+		if (face->direct[i])
+			wlt_glyph_free(&face->direct[i]->glyph);
+	free(face->direct);
+	wlt_disk_cache_close(face->disk);
+	for (i = 0; i < face->n_worker_ctx; ++i)
+		if (face->worker_ctx[i])
+			g_object_unref(face->worker_ctx[i]);
+	free(face->worker_ctx);
+	if (face->ctx)
+		g_object_unref(face->ctx);
+	pango_font_description_free(face->desc);
 	wlt_font_unref(face->font);
 	free(face);
 }
 
+/* the metrics are 0 if the face failed to load */
 unsigned int wlt_face_get_width(struct wlt_face *face)
 {
-	return face->width;
+	face_load(face);
+	return face->metrics.width;
 }
 
 unsigned int wlt_face_get_height(struct wlt_face *face)
 {
-	return face->height;
+	face_load(face);
+	return face->metrics.height;
+}
+
+/* all zero if the face failed to load */
+void wlt_face_get_metrics(struct wlt_face *face, struct wlt_face_metrics *out)
+{
+	face_load(face);
+	*out = face->metrics;
+}
+
+/* glyph cache counters of this face only; sizes are tracked per font */
+void wlt_face_get_stats(struct wlt_face *face, struct wlt_cache_stats *out)
+{
+	*out = face->stats;
 }
 
 static unsigned int c2f(cairo_format_t format)
@@ -299,16 +813,14 @@ static unsigned int c2f(cairo_format_t format)
 	}
 }
 
-static int create_glyph(struct wlt_face *face, struct wlt_glyph *glyph,
-			const uint32_t *ch, size_t len)
+static int create_glyph(struct wlt_face *face, PangoContext *ctx,
+			struct wlt_glyph *glyph, const uint32_t *ch, size_t len)
 {
 	PangoLayoutLine *line;
 	cairo_surface_t *surface;
 	PangoRectangle rec;
 	cairo_format_t format;
 	PangoLayout *layout;
-	PangoAttrList *attrl;
-	PangoAttribute *uline;
 	cairo_t *cr;
 	size_t cnt;
 	glong ulen;
@@ -317,9 +829,9 @@ static int create_glyph(struct wlt_face *face, struct wlt_glyph *glyph,
 
 	format = CAIRO_FORMAT_A8;
 	glyph->format = c2f(format);
-	glyph->width = face->width * glyph->cwidth;
+	glyph->width = face->metrics.width * glyph->cwidth;
 	glyph->stride = cairo_format_stride_for_width(format, glyph->width);
-	glyph->height = face->height;
+	glyph->height = face->metrics.height;
 
 	glyph->buffer = calloc(1, glyph->stride * glyph->height);
 	if (!glyph->buffer)
@@ -341,8 +853,8 @@ static int create_glyph(struct wlt_face *face, struct wlt_glyph *glyph,
 		goto err_surface;
 	}
 
-	pango_cairo_update_context(cr, face->ctx);
-	layout = pango_layout_new(face->ctx);
+	pango_cairo_update_context(cr, ctx);
+	layout = pango_layout_new(ctx);
 
 	val = g_ucs4_to_utf8(ch, len, NULL, &ulen, NULL);
 	if (!val) {
@@ -359,14 +871,6 @@ static int create_glyph(struct wlt_face *face, struct wlt_glyph *glyph,
 
 	g_free(val);
 
-	if (face->underline) {
-		attrl = pango_attr_list_new();
-		uline = pango_attr_underline_new(PANGO_UNDERLINE_SINGLE);
-		pango_attr_list_insert(attrl, uline);
-		pango_layout_set_attributes(layout, attrl);
-		pango_attr_list_unref(attrl);
-	}
-
 	cnt = pango_layout_get_line_count(layout);
 	if (cnt == 0) {
 		r = -ERANGE;
@@ -376,7 +880,7 @@ static int create_glyph(struct wlt_face *face, struct wlt_glyph *glyph,
 	line = pango_layout_get_line_readonly(layout, 0);
 	pango_layout_line_get_pixel_extents(line, NULL, &rec);
 
-	cairo_move_to(cr, -rec.x, face->baseline),
+	cairo_move_to(cr, -rec.x, face->metrics.baseline),
 	cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
 	pango_cairo_show_layout_line(cr, line);
 
@@ -395,52 +899,625 @@ err_buffer:
 	return r;
 }
 
-int wlt_face_render(struct wlt_face *face, struct wlt_glyph **out,
-		    unsigned long id, const uint32_t *ch, size_t len,
-		    size_t cwidth)
+/*
+ * Glyph Cache
+ * Rendered glyphs are kept per face. All faces of a font share one memory
+ * budget and glyphs are evicted in LRU order once it is exceeded. Glyphs used
+ * during the current frame are pinned; if all glyphs are pinned, the budget is
+ * exceeded temporarily rather than failing the draw. A budget of 0 means
+ * unlimited.
+ *
+ * Glyphs are keyed by their codepoint sequence, not by tsm id: tsm allocates
+ * ids of combining sequences per screen, so the same id can mean different
+ * clusters in different windows sharing a face. A single codepoint is its own
+ * key, as it is for tsm. Sequences get a font-wide key the first time they are
+ * seen. The entry is dropped with the last cached glyph of any face using it,
+ * so the table is bounded by the glyph budget. Keys are never reused, so a
+ * pre-colored entry left over from a dropped key can't match a new sequence.
+ *
+ * Nearly every cell on screen holds a single codepoint from ASCII or Latin-1.
+ * Each face looks these up in a flat array indexed by key, which takes a
+ * single load. Combining sequences and everything above Latin-1 go through
+ * the hash table.
+ */
+
+/* get the key to pass to wlt_face_render() and friends for @ch */
+int wlt_face_get_key(struct wlt_face *face, unsigned long *out,
+		     const uint32_t *ch, size_t len)
 {
-	struct wlt_glyph *glyph;
-	unsigned long *gid;
-	bool b;
+	struct wlt_font *font = face->font;
+	struct wlt_sequence *s;
 	int r;
 
-	b = shl_htable_lookup_ulong(&face->glyphs, id, &gid);
-	if (b) {
-		*out = wlt_to_glyph(gid);
+	if (!len)
+		return -EINVAL;
+	if (len == 1) {
+		*out = *ch;
 		return 0;
 	}
 
-	if (!len || !cwidth)
-		return -EINVAL;
+	s = wlt_font_find_sequence(font, ch, len);
+	if (s) {
+		*out = s->key;
+		return 0;
+	}
+
+	s = malloc(sizeof(*s) + len * sizeof(*ch));
+	if (!s)
+		return -ENOMEM;
+	s->key = font->next_sequence;
+	s->ref = 0;
+	s->len = len;
+	s->ch = memcpy(s + 1, ch, len * sizeof(*ch));
+
+	r = shl_htable_insert(&font->sequences, s, hash_sequence(ch, len));
+	if (r < 0) {
+		free(s);
+		return r;
+	}
+
+	++font->next_sequence;
+	*out = s->key;
+	return 0;
+}
+
+static struct wlt_cached *face_lookup(struct wlt_face *face, unsigned long id)
+{
+	unsigned long *gid;
+
+	if (id < WLT_FACE_DIRECT)
+		return face->direct[id];
+	if (!shl_htable_lookup_ulong(&face->glyphs, id, &gid))
+		return NULL;
+
+	return wlt_to_cached(wlt_to_glyph(gid));
+}
+
+static int face_insert(struct wlt_face *face, struct wlt_cached *c)
+{
+	if (c->glyph.id < WLT_FACE_DIRECT) {
+		face->direct[c->glyph.id] = c;
+		return 0;
+	}
+
+	return shl_htable_insert_ulong(&face->glyphs, &c->glyph.id);
+}
+
+static void face_remove(struct wlt_face *face, unsigned long id)
+{
+	unsigned long *gid;
+
+	if (id < WLT_FACE_DIRECT)
+		face->direct[id] = NULL;
+	else
+		shl_htable_remove_ulong(&face->glyphs, id, &gid);
+}
+
+static void wlt_font_evict_glyphs(struct wlt_font *font, size_t need)
+{
+	struct wlt_cached *c;
+
+	if (!font->glyphs_max)
+		return;
+
+	while (!shl_dlist_empty(&font->glyphs) &&
+	       font->glyphs_size + need > font->glyphs_max) {
+		c = shl_dlist_last(&font->glyphs, struct wlt_cached, list);
+		if (c->frame == font->frame)
+			break;
+
+		face_remove(c->face, c->glyph.id);
+		wlt_glyph_free(&c->glyph);
+		++font->glyph_stats.evictions;
+	}
+}
+
+/* only affects faces that are not loaded yet */
+void wlt_font_set_disk_cache(struct wlt_font *font, bool enable)
+{
+	font->disk_cache = enable;
+}
+
+void wlt_font_set_glyph_cache(struct wlt_font *font, size_t size)
+{
+	font->glyphs_max = size;
+	wlt_font_evict_glyphs(font, 0);
+}
 
-	glyph = calloc(1, sizeof(*glyph));
-	if (!glyph)
+/*
+ * Turn @c into a tombstone. Glyphs that cannot be rasterized (invalid
+ * sequences, nothing to lay out, OOM) would otherwise be retried on every
+ * frame. Tombstones stay in the table like any other glyph and make the
+ * lookup fail with the original error. They are subject to LRU eviction, so
+ * transient failures are retried eventually.
+ */
+static void wlt_glyph_fail(struct wlt_cached *c, int error)
+{
+	c->error = error;
+	c->size = sizeof(*c);
+	c->glyph.format = WLT_GLYPH_INVALID;
+	c->glyph.width = 0;
+	c->glyph.height = 0;
+	c->glyph.stride = 0;
+	c->glyph.buffer = NULL;
+	c->glyph.cr_surface = NULL;
+	++c->face->font->glyph_stats.failures;
+	++c->face->stats.failures;
+}
+
+/*
+ * Asynchronous Rasterization
+ * Rasterizing a glyph through pango can take a significant amount of time,
+ * so if a raster pool is set, misses are handed to it instead. A pending entry
+ * is put into the glyph table right away, so each glyph is queued only once,
+ * and wlt_face_render() returns -EAGAIN until it is done. Each worker uses its
+ * own PangoContext per face, created from the font map pango keeps for that
+ * thread. Finished jobs are collected on the main loop, which publishes the
+ * glyphs and tells the owner to redraw.
+ */
+
+static void wlt_font_finish_job(struct wlt_font *font,
+				struct wlt_raster_job *job)
+{
+	struct wlt_face *face = job->face;
+	struct wlt_cached *c = job->c;
+
+	c->pending = false;
+	c->frame = font->frame;
+	if (job->error < 0)
+		wlt_glyph_fail(c, job->error);
+	else
+		c->size = sizeof(*c) +
+			  (size_t)c->glyph.stride * c->glyph.height;
+
+	wlt_font_evict_glyphs(font, c->size);
+	shl_dlist_link(&font->glyphs, &c->list);
+	font->glyphs_size += c->size;
+
+	wlt_face_unref(face);
+	free(job);
+}
+
+/* move all finished jobs out of the shared list and publish them */
+static size_t wlt_font_collect(struct wlt_font *font)
+{
+	struct shl_dlist done, *iter, *tmp;
+	size_t n = 0;
+
+	shl_dlist_init(&done);
+
+	g_mutex_lock(&font->raster_lock);
+	font->raster_src = 0;
+	shl_dlist_for_each_safe(iter, tmp, &font->raster_done) {
+		shl_dlist_unlink(iter);
+		shl_dlist_link_tail(&done, iter);
+	}
+	g_mutex_unlock(&font->raster_lock);
+
+	shl_dlist_for_each_safe(iter, tmp, &done) {
+		shl_dlist_unlink(iter);
+		wlt_font_finish_job(font, shl_dlist_entry(iter,
+						struct wlt_raster_job, list));
+		++n;
+	}
+
+	return n;
+}
+
+static gboolean wlt_font_raster_cb(gpointer data)
+{
+	struct wlt_font *font = data;
+
+	if (wlt_font_collect(font) && font->raster_cb)
+		font->raster_cb(font, font->raster_data);
+
+	return FALSE;
+}
+
+static void wlt_font_raster_job(unsigned int worker, void *data)
+{
+	struct wlt_raster_job *job = data;
+	struct wlt_face *face = job->face;
+	struct wlt_font *font = face->font;
+	PangoContext **ctx = &face->worker_ctx[worker];
+
+	if (!*ctx)
+		*ctx = create_context(face, pango_cairo_font_map_get_default());
+
+	if (*ctx)
+		job->error = create_glyph(face, *ctx, &job->c->glyph, job->ch,
+					  job->len);
+	else
+		job->error = -ENOMEM;
+
+	g_mutex_lock(&font->raster_lock);
+	shl_dlist_link_tail(&font->raster_done, &job->list);
+	if (!font->raster_src)
+		font->raster_src = g_idle_add(wlt_font_raster_cb, font);
+	g_mutex_unlock(&font->raster_lock);
+}
+
+static int wlt_face_queue(struct wlt_face *face, struct wlt_cached *c,
+			  const uint32_t *ch, size_t len)
+{
+	struct wlt_font *font = face->font;
+	struct wlt_raster_job *job;
+	unsigned int n;
+	int r;
+
+	n = wlt_pool_get_size(font->raster);
+	if (face->n_worker_ctx < n) {
+		PangoContext **t;
+
+		t = realloc(face->worker_ctx, n * sizeof(*t));
+		if (!t)
+			return -ENOMEM;
+		memset(&t[face->n_worker_ctx], 0,
+		       (n - face->n_worker_ctx) * sizeof(*t));
+		face->worker_ctx = t;
+		face->n_worker_ctx = n;
+	}
+
+	job = calloc(1, sizeof(*job) + len * sizeof(*ch));
+	if (!job)
 		return -ENOMEM;
-	glyph->id = id;
-	glyph->cwidth = cwidth;
+	job->face = face;
+	job->c = c;
+	job->len = len;
+	memcpy(job->ch, ch, len * sizeof(*ch));
+
+	c->pending = true;
+	wlt_face_ref(face);
+
+	r = wlt_pool_push(font->raster, wlt_font_raster_job, job);
+	if (r < 0) {
+		c->pending = false;
+		wlt_face_unref(face);
+		free(job);
+		return r;
+	}
+
+	return 0;
+}
+
+/*
+ * Start a pool of @threads rasterizer threads, or stop it if 0. @cb is invoked
+ * on the main loop whenever glyphs that were reported as pending are ready.
+ * When stopping, all queued glyphs are finished first.
+ */
+int wlt_font_set_raster_threads(struct wlt_font *font, unsigned int threads,
+				wlt_font_cb cb, void *data)
+{
+	struct wlt_pool *pool = NULL;
+	int r;
+
+	if (threads) {
+		r = wlt_pool_new(&pool, threads);
+		if (r < 0)
+			return r;
+	}
+
+	if (font->raster) {
+		wlt_pool_free(font->raster);
+		font->raster = NULL;
+
+		g_mutex_lock(&font->raster_lock);
+		if (font->raster_src)
+			g_source_remove(font->raster_src);
+		g_mutex_unlock(&font->raster_lock);
+		wlt_font_collect(font);
+	}
+
+	font->raster = pool;
+	font->raster_cb = cb;
+	font->raster_data = data;
 
-	r = create_glyph(face, glyph, ch, len);
+	return 0;
+}
+
+/* Queue printable ASCII of a new face. A single codepoint is its own glyph
+ * key, so these are exactly the keys the renderer will ask for. */
+static void wlt_face_prewarm(struct wlt_face *face)
+{
+	struct wlt_glyph *glyph;
+	uint32_t ch;
+
+	for (ch = 0x20; ch < 0x7f; ++ch)
+		wlt_face_render(face, &glyph, ch, &ch, 1, 1,
+				face->metrics.width, face->metrics.height);
+}
+
+/*
+ * Get the glyph of @ch with key @id, spanning @cwidth cells. Built-in glyphs
+ * are generated to fill exactly @cwidth cells of @cell_width x @cell_height,
+ * which is the cell size of the plain face, so borders of bold and italic
+ * text tile with plain ones. A cached built-in glyph of a different cell size
+ * is replaced unless it is in use in the current frame.
+ */
+int wlt_face_render(struct wlt_face *face, struct wlt_glyph **out,
+		    unsigned long id, const uint32_t *ch, size_t len,
+		    size_t cwidth, unsigned int cell_width,
+		    unsigned int cell_height)
+{
+	struct wlt_font *font = face->font;
+	struct wlt_sequence *seq;
+	struct wlt_cached *c;
+	int r;
+
+	r = face_load(face);
 	if (r < 0)
-		goto err_free;
+		goto err_seq;
+
+	c = face_lookup(face, id);
+	if (c && c->builtin && !c->error && c->frame != font->frame &&
+	    (c->glyph.width != cell_width * cwidth ||
+	     c->glyph.height != cell_height)) {
+		face_remove(face, id);
+		wlt_glyph_free(&c->glyph);
+		c = NULL;
+	}
+	if (c) {
+		if (c->pending)
+			return -EAGAIN;
+
+		c->frame = font->frame;
+		shl_dlist_unlink(&c->list);
+		shl_dlist_link(&font->glyphs, &c->list);
+
+		++font->glyph_stats.hits;
+		++face->stats.hits;
+		if (c->error)
+			return c->error;
+
+		*out = &c->glyph;
+		return 0;
+	}
+
+	if (!len || !cwidth) {
+		r = -EINVAL;
+		goto err_seq;
+	}
 
-	r = shl_htable_insert_ulong(&face->glyphs, &glyph->id);
+	++font->glyph_stats.misses;
+	++face->stats.misses;
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		r = -ENOMEM;
+		goto err_seq;
+	}
+	c->face = face;
+	c->frame = font->frame;
+	c->glyph.id = id;
+	c->glyph.cwidth = cwidth;
+	if (len > 1) {
+		c->seq = wlt_font_find_sequence(font, ch, len);
+		if (c->seq)
+			++c->seq->ref;
+	}
+
+	/* box drawing and friends skip pango and the raster threads */
+	r = len == 1 ? wlt_boxdraw_render(&c->glyph, *ch, cell_width * cwidth,
+					  cell_height) : -ENOENT;
+	if (r != -ENOENT) {
+		c->builtin = true;
+		if (r < 0)
+			wlt_glyph_fail(c, r);
+		else
+			c->size = sizeof(*c) +
+				  (size_t)c->glyph.stride * c->glyph.height;
+	} else if (face->disk && wlt_disk_cache_lookup(face->disk, &c->glyph,
+						       ch, len, cwidth) >= 0) {
+		/* the bitmap lives in the shared mapping */
+		c->mapped = true;
+		c->size = sizeof(*c);
+	} else if (font->raster) {
+		r = face_insert(face, c);
+		if (r < 0)
+			goto err_free;
+
+		r = wlt_face_queue(face, c, ch, len);
+		if (r < 0) {
+			face_remove(face, id);
+			goto err_free;
+		}
+
+		return -EAGAIN;
+	} else {
+		r = init_pango(face);
+		if (r < 0)
+			goto err_free;
+
+		r = create_glyph(face, face->ctx, &c->glyph, ch, len);
+		if (r < 0)
+			wlt_glyph_fail(c, r);
+		else
+			c->size = sizeof(*c) +
+				  (size_t)c->glyph.stride * c->glyph.height;
+	}
+	wlt_font_evict_glyphs(font, c->size);
+
+	r = face_insert(face, c);
 	if (r < 0)
 		goto err_glyph;
 
-	*out = glyph;
+	shl_dlist_link(&font->glyphs, &c->list);
+	font->glyphs_size += c->size;
+
+	if (c->error)
+		return c->error;
+
+	*out = &c->glyph;
 	return 0;
 
 err_glyph:
-	free(glyph->buffer);
+	if (!c->mapped) {
+		cairo_surface_destroy(c->glyph.cr_surface);
+		free(c->glyph.buffer);
+	}
 err_free:
-	free(glyph);
+	seq = c->seq;
+	if (seq)
+		--seq->ref;
+	free(c);
+	wlt_font_put_sequence(font, seq);
+	return r;
+
+err_seq:
+	/* don't leave an entry behind for a key that got no glyph */
+	if (len > 1)
+		wlt_font_put_sequence(font,
+				      wlt_font_find_sequence(font, ch, len));
+	return r;
+}
+
+/*
+ * Pre-colored Glyphs
+ * Terminals use a handful of fg/bg combinations over and over again. Instead
+ * of blending the A8 mask of a glyph on every draw, the renderer can keep the
+ * already blended ARGB32 cell around, keyed by glyph key and the resolved
+ * colors. A hit turns drawing into a plain copy. Entries of all faces of a
+ * font share one memory budget and are evicted in LRU order. Entries used in
+ * the current frame are pinned, as the renderer may still reference them.
+ */
+
+static void wlt_font_evict_colored(struct wlt_font *font, size_t need)
+{
+	struct wlt_colored *c;
+	struct wlt_color_glyph *cg;
+
+	while (!shl_dlist_empty(&font->colored) &&
+	       font->colored_size + need > font->colored_max) {
+		c = shl_dlist_last(&font->colored, struct wlt_colored, list);
+		if (c->frame == font->frame)
+			break;
+
+		shl_htable_remove(&c->face->colored, &c->cglyph,
+				  rehash_colored(&c->cglyph, NULL),
+				  (void**)&cg);
+		free_colored(&c->cglyph, NULL);
+		++font->colored_stats.evictions;
+	}
+}
+
+void wlt_font_set_color_cache(struct wlt_font *font, size_t size)
+{
+	font->colored_max = size;
+	wlt_font_evict_colored(font, 0);
+}
+
+/*
+ * Look up a pre-colored glyph. Returns -ENOENT if there is none, and -EBUSY
+ * if it was added during this frame but not filled in yet.
+ */
+int wlt_face_lookup_color(struct wlt_face *face,
+			  struct wlt_color_glyph **out,
+			  unsigned long id, uint32_t fc, uint32_t bc)
+{
+	struct wlt_font *font = face->font;
+	struct wlt_color_glyph key, *cg;
+	struct wlt_colored *c;
+	bool b;
+
+	if (!font->colored_max)
+		return -ENOENT;
+
+	key.id = id;
+	key.fc = fc;
+	key.bc = bc;
+	b = shl_htable_lookup(&face->colored, &key, hash_colored(id, fc, bc),
+			      (void**)&cg);
+	if (!b) {
+		++font->colored_stats.misses;
+		return -ENOENT;
+	}
+	if (!cg->ready)
+		return -EBUSY;
+
+	c = wlt_to_colored(cg);
+	c->frame = font->frame;
+	shl_dlist_unlink(&c->list);
+	shl_dlist_link(&font->colored, &c->list);
+
+	++font->colored_stats.hits;
+	*out = cg;
+	return 0;
+}
+
+/*
+ * Allocate a pre-colored entry for @glyph, clipped to @max_height rows. The
+ * buffer is left uninitialized; the caller blends into it and then sets
+ * @ready. Returns -ENOSPC if the budget is exhausted by pinned entries.
+ */
+int wlt_face_add_color(struct wlt_face *face, struct wlt_color_glyph **out,
+		       const struct wlt_glyph *glyph, uint32_t fc, uint32_t bc,
+		       unsigned int max_height)
+{
+	struct wlt_font *font = face->font;
+	struct wlt_colored *c;
+	unsigned int height;
+	size_t size;
+	int r;
+
+	if (glyph->format != WLT_GLYPH_A8)
+		return -EINVAL;
+
+	height = glyph->height < max_height ? glyph->height : max_height;
+	size = sizeof(*c) + (size_t)glyph->width * height * 4;
+
+	wlt_font_evict_colored(font, size);
+	if (font->colored_size + size > font->colored_max)
+		return -ENOSPC;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+	c->face = face;
+	c->frame = font->frame;
+	c->size = size;
+	c->cglyph.id = glyph->id;
+	c->cglyph.fc = fc;
+	c->cglyph.bc = bc;
+	c->cglyph.width = glyph->width;
+	c->cglyph.height = height;
+
+	c->cglyph.buffer = malloc((size_t)glyph->width * height * 4);
+	if (!c->cglyph.buffer) {
+		r = -ENOMEM;
+		goto err_free;
+	}
+
+	r = shl_htable_insert(&face->colored, &c->cglyph,
+			      hash_colored(glyph->id, fc, bc));
+	if (r < 0)
+		goto err_buffer;
+
+	shl_dlist_link(&font->colored, &c->list);
+	font->colored_size += size;
+
+	*out = &c->cglyph;
+	return 0;
+
+err_buffer:
+	free(c->cglyph.buffer);
+err_free:
+	free(c);
 	return r;
 }
 
 static void wlt_glyph_free(struct wlt_glyph *glyph)
 {
+	struct wlt_cached *c = wlt_to_cached(glyph);
+	struct wlt_font *font = c->face->font;
+
+	shl_dlist_unlink(&c->list);
+	font->glyphs_size -= c->size;
+	if (c->seq && !--c->seq->ref)
+		wlt_font_put_sequence(font, c->seq);
+
 	if (glyph->cr_surface)
 		cairo_surface_destroy(glyph->cr_surface);
-	free(glyph->buffer);
-	free(glyph);
+	if (!c->mapped)
+		free(glyph->buffer);
+	free(c);
 }
@@ -0,0 +1,415 @@
+/*
+ * wlterm - headless renderer
+ *
+ * Copyright (c) 2017 Pamelloes <pamelloes@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Headless Renderer
+ * This feeds a byte stream into a tsm screen and renders it through the
+ * regular renderer into its shadow buffer, without any window, display or
+ * GTK. It is meant for rendering benchmarks and golden-image tests on
+ * machines without a display. The input is fed in chunks, the way it would
+ * arrive from a pty, and a frame is rendered after each chunk. Timing is
+ * printed to stderr; the final frame can be written as PPM or PNG.
+ *
+ * Built-in configuration defaults are used and the persistent glyph cache is
+ * bypassed, so the output does not depend on the configuration or the cache
+ * state of the machine it runs on.
+ */
+
+#include <cairo.h>
+#include <errno.h>
+#include <glib.h>
+#include <libtsm.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wlterm.h"
+
+struct headless {
+	struct wlt_config *config;
+	struct wlt_font *font;
+	struct wlt_face *faces[4];
+	struct wlt_renderer *rend;
+	struct tsm_screen *screen;
+	struct tsm_vte *vte;
+	struct wlt_stats *stats;
+	unsigned int cell_width;
+	unsigned int cell_height;
+	unsigned int columns;
+	unsigned int rows;
+};
+
+static void err(const char *format, ...)
+{
+	va_list list;
+
+	fprintf(stderr, "ERROR: ");
+
+	va_start(list, format);
+	vfprintf(stderr, format, list);
+	va_end(list);
+
+	fprintf(stderr, "\n");
+}
+
+static void log_tsm(void *data, const char *file, int line, const char *fn,
+		    const char *subs, unsigned int sev, const char *format,
+		    va_list args)
+{
+	/* only report errors and worse; parsing garbage is expected */
+	if (sev > 3)
+		return;
+
+	fprintf(stderr, "tsm: %s: ", subs);
+	vfprintf(stderr, format, args);
+	fprintf(stderr, "\n");
+}
+
+/* there is no pty; answers of the vte (DA, DSR, ...) are dropped */
+static void write_cb(struct tsm_vte *vte, const char *u8, size_t len,
+		     void *data)
+{
+}
+
+static void headless_fill_ctx(struct headless *hl, struct wlt_draw_ctx *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->config = hl->config;
+	ctx->rend = hl->rend;
+	ctx->font = hl->font;
+	memcpy(ctx->faces, hl->faces, sizeof(hl->faces));
+	ctx->cell_width = hl->cell_width;
+	ctx->cell_height = hl->cell_height;
+	ctx->screen = hl->screen;
+	ctx->vte = hl->vte;
+	ctx->x2 = hl->columns * hl->cell_width;
+	ctx->y2 = hl->rows * hl->cell_height;
+}
+
+static void headless_free(struct headless *hl)
+{
+	tsm_vte_unref(hl->vte);
+	tsm_screen_unref(hl->screen);
+	wlt_renderer_free(hl->rend);
+	for (int i = 0; i < 4; ++i)
+		wlt_face_unref(hl->faces[i]);
+	wlt_font_unref(hl->font);
+	wlt_config_unref(hl->config);
+	wlt_stats_free(hl->stats);
+	free(hl);
+}
+
+static int headless_new(struct headless **out, const char *font_name,
+			int font_size, unsigned int columns,
+			unsigned int rows, const char *palette)
+{
+	struct headless *hl;
+	int r, i;
+
+	hl = calloc(1, sizeof(*hl));
+	if (!hl)
+		return -ENOMEM;
+	hl->columns = columns;
+	hl->rows = rows;
+
+	r = wlt_stats_new(&hl->stats);
+	if (r < 0)
+		goto error;
+
+	r = wlt_config_new_default(&hl->config);
+	if (r < 0)
+		goto error;
+
+	r = wlt_font_new(&hl->font);
+	if (r < 0)
+		goto error;
+
+	/* a stale persistent cache would change the output, and runs must not
+	 * write into the cache of the user */
+	wlt_font_set_disk_cache(hl->font, false);
+	wlt_font_set_glyph_cache(hl->font, 1024 *
+			(size_t)wlt_config_get_glyph_cache_size(hl->config));
+	wlt_font_set_color_cache(hl->font, 1024 *
+			(size_t)wlt_config_get_color_cache_size(hl->config));
+
+	/* Glyphs are rasterized synchronously; there is no main loop to
+	 * deliver background results and we want deterministic frames. */
+	r = wlt_face_new(&hl->faces[0], hl->font, font_name, font_size, 0);
+	if (r < 0)
+		goto error;
+	for (i = 1; i < 4; ++i) {
+		r = wlt_face_new_lazy(&hl->faces[i], hl->font, font_name,
+				      font_size, i);
+		if (r < 0)
+			goto error;
+	}
+
+	hl->cell_width = wlt_face_get_width(hl->faces[0]);
+	hl->cell_height = wlt_face_get_height(hl->faces[0]);
+
+	r = wlt_renderer_new(&hl->rend, columns * hl->cell_width,
+			     rows * hl->cell_height);
+	if (r < 0)
+		goto error;
+
+	r = tsm_screen_new(&hl->screen, log_tsm, hl);
+	if (r < 0)
+		goto error;
+
+	tsm_screen_set_max_sb(hl->screen, 0);
+	r = tsm_screen_resize(hl->screen, columns, rows);
+	if (r < 0)
+		goto error;
+
+	r = tsm_vte_new(&hl->vte, hl->screen, write_cb, hl, log_tsm, hl);
+	if (r < 0)
+		goto error;
+
+	if (palette) {
+		r = tsm_vte_set_palette(hl->vte, palette);
+		if (r < 0)
+			goto error;
+	}
+
+	*out = hl;
+	return 0;
+
+error:
+	headless_free(hl);
+	return r;
+}
+
+static int write_ppm(struct headless *hl, const char *path)
+{
+	cairo_surface_t *surface;
+	const uint8_t *data;
+	const uint32_t *row;
+	unsigned int x, y, w, h;
+	int stride, r = 0;
+	FILE *f;
+
+	surface = wlt_renderer_get_surface(hl->rend);
+	cairo_surface_flush(surface);
+	data = cairo_image_surface_get_data(surface);
+	stride = cairo_image_surface_get_stride(surface);
+	w = cairo_image_surface_get_width(surface);
+	h = cairo_image_surface_get_height(surface);
+
+	f = fopen(path, "wb");
+	if (!f)
+		return -errno;
+
+	fprintf(f, "P6\n%u %u\n255\n", w, h);
+	for (y = 0; y < h; ++y) {
+		row = (const uint32_t*)&data[y * stride];
+		for (x = 0; x < w; ++x) {
+			fputc((row[x] >> 16) & 0xff, f);
+			fputc((row[x] >> 8) & 0xff, f);
+			fputc(row[x] & 0xff, f);
+		}
+	}
+
+	if (ferror(f))
+		r = -EIO;
+	if (fclose(f) && !r)
+		r = -errno;
+
+	return r;
+}
+
+static int write_png(struct headless *hl, const char *path)
+{
+	cairo_status_t st;
+
+	st = cairo_surface_write_to_png(wlt_renderer_get_surface(hl->rend),
+					path);
+
+	return st == CAIRO_STATUS_SUCCESS ? 0 : -EIO;
+}
+
+int main(int argc, char **argv)
+{
+	GOptionContext *opt;
+	GError *e = NULL;
+	struct headless *hl;
+	struct wlt_draw_ctx ctx;
+	gchar *input = NULL;
+	gsize input_len;
+	int64_t start, t, end, parse_time = 0, render_time = 0;
+	unsigned long frames = 0;
+	size_t pos, len;
+	double secs;
+	int r, i;
+
+	char *font_name = NULL;
+	int font_size = 10;
+	int columns = 80;
+	int rows = 24;
+	int chunk = 16384;
+	int repeat = 1;
+	char *palette = NULL;
+	char *ppm = NULL;
+	char *png = NULL;
+
+	GOptionEntry opts[] = {
+		{ "font-name",     'f', G_OPTION_FLAG_NONE,    G_OPTION_ARG_STRING,
+			&font_name,  "Typeface name; defaults to 'monospace'",     NULL },
+		{ "font-size",     's', G_OPTION_FLAG_NONE,    G_OPTION_ARG_INT,
+			&font_size,  "Font size in pixels; defaults to 10",        NULL },
+		{ "columns",       0,   G_OPTION_FLAG_NONE,    G_OPTION_ARG_INT,
+			&columns,    "Screen width in cells; defaults to 80",      NULL },
+		{ "rows",          0,   G_OPTION_FLAG_NONE,    G_OPTION_ARG_INT,
+			&rows,       "Screen height in cells; defaults to 24",     NULL },
+		{ "chunk",         0,   G_OPTION_FLAG_NONE,    G_OPTION_ARG_INT,
+			&chunk,      "Bytes parsed per frame; defaults to 16384",  NULL },
+		{ "repeat",        0,   G_OPTION_FLAG_NONE,    G_OPTION_ARG_INT,
+			&repeat,     "Feed the input this many times",             NULL },
+		{ "palette",       'p', G_OPTION_FLAG_NONE,    G_OPTION_ARG_STRING,
+			&palette,    "Set the terminal's color palette",           NULL },
+		{ "ppm",           0,   G_OPTION_FLAG_NONE,    G_OPTION_ARG_FILENAME,
+			&ppm,        "Write the final frame as PPM",               NULL },
+		{ "png",           0,   G_OPTION_FLAG_NONE,    G_OPTION_ARG_FILENAME,
+			&png,        "Write the final frame as PNG",               NULL },
+		{ NULL }
+	};
+
+	opt = g_option_context_new("[FILE]");
+	g_option_context_set_summary(opt, "Render a byte stream through the "
+		"wlterm renderer without a display. Reads stdin if no FILE "
+		"is given.");
+	g_option_context_add_main_entries(opt, opts, NULL);
+	if (!g_option_context_parse(opt, &argc, &argv, &e)) {
+		err("cannot parse arguments: %s", e->message);
+		g_error_free(e);
+		g_option_context_free(opt);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free(opt);
+
+	if (columns <= 0 || rows <= 0 || chunk <= 0 || repeat <= 0) {
+		err("columns, rows, chunk and repeat must be positive");
+		r = -EINVAL;
+		goto err_opts;
+	}
+
+	if (argc > 1) {
+		if (!g_file_get_contents(argv[1], &input, &input_len, &e)) {
+			err("cannot read %s: %s", argv[1], e->message);
+			g_error_free(e);
+			r = -EIO;
+			goto err_opts;
+		}
+	} else {
+		GIOChannel *chan = g_io_channel_unix_new(0);
+
+		g_io_channel_set_encoding(chan, NULL, NULL);
+		if (g_io_channel_read_to_end(chan, &input, &input_len, &e) !=
+		    G_IO_STATUS_NORMAL) {
+			err("cannot read stdin: %s", e->message);
+			g_error_free(e);
+			g_io_channel_unref(chan);
+			r = -EIO;
+			goto err_opts;
+		}
+		g_io_channel_unref(chan);
+	}
+
+	r = headless_new(&hl, font_name ? font_name : "monospace", font_size,
+			 columns, rows, palette);
+	if (r < 0) {
+		errno = -r;
+		err("cannot initialize renderer: %m");
+		goto err_input;
+	}
+
+	headless_fill_ctx(hl, &ctx);
+
+	for (i = 0; i < repeat; ++i) {
+		for (pos = 0; pos < input_len; pos += len) {
+			len = input_len - pos;
+			if (len > (size_t)chunk)
+				len = chunk;
+
+			ctx.may_scroll = wlt_vte_may_scroll(&input[pos], len);
+			start = g_get_monotonic_time();
+			tsm_vte_input(hl->vte, &input[pos], len);
+			t = g_get_monotonic_time();
+			wlt_renderer_update(&ctx);
+			end = g_get_monotonic_time();
+			render_time += end - t;
+			parse_time += t - start;
+			++frames;
+			wlt_stats_add_input(hl->stats, len);
+			wlt_stats_add_time(hl->stats, WLT_STATS_UPDATE,
+					   end - t);
+		}
+	}
+
+	/* make sure the dump shows the final state, even for empty input */
+	ctx.may_scroll = false;
+	t = g_get_monotonic_time();
+	wlt_renderer_update(&ctx);
+	end = g_get_monotonic_time();
+	render_time += end - t;
+	++frames;
+	wlt_stats_add_time(hl->stats, WLT_STATS_UPDATE, end - t);
+
+	secs = (parse_time + render_time) / 1000000.0;
+	fprintf(stderr, "bytes: %zu\n", (size_t)input_len * repeat);
+	fprintf(stderr, "frames: %lu\n", frames);
+	fprintf(stderr, "parse: %.3f ms (%.2f MB/s)\n", parse_time / 1000.0,
+		parse_time ? input_len * (double)repeat / parse_time : 0.0);
+	fprintf(stderr, "render: %.3f ms (%.3f ms/frame)\n",
+		render_time / 1000.0, render_time / 1000.0 / frames);
+	fprintf(stderr, "total: %.3f s (%.1f frames/s)\n", secs,
+		secs > 0 ? frames / secs : 0.0);
+	wlt_stats_dump(hl->stats, stderr, &ctx);
+
+	if (ppm) {
+		r = write_ppm(hl, ppm);
+		if (r < 0) {
+			errno = -r;
+			err("cannot write %s: %m", ppm);
+		}
+	}
+
+	if (png && r >= 0) {
+		r = write_png(hl, png);
+		if (r < 0)
+			err("cannot write %s", png);
+	}
+
+	headless_free(hl);
+err_input:
+	g_free(input);
+err_opts:
+	g_free(png);
+	g_free(ppm);
+	g_free(palette);
+	g_free(font_name);
+	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
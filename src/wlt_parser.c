@@ -0,0 +1,366 @@
+/*
+ * wlterm - parser thread
+ *
+ * Copyright (c) 2017 Pamelloes <pamelloes@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Parser Thread
+ * Takes the output of a pty reader and feeds it through tsm_vte_input() on a
+ * thread of its own, so parsing and rendering run on separate cores. The
+ * parser owns the tsm_vte/tsm_screen pair. The main thread only sees
+ * snapshots of the screen, which it draws without any locking.
+ *
+ * Snapshots are triple-buffered: the main thread draws the front one, the
+ * parser captures into the back one, and the third is the hand-off slot.
+ * Publishing swaps back and hand-off, acquiring swaps front and hand-off,
+ * both with a single atomic exchange. The parser only captures when the
+ * main thread took the previous snapshot, so a flood is parsed at full speed
+ * while at most one snapshot per frame is taken.
+ *
+ * The main thread still needs the screen for keyboard input, selections,
+ * scroll-back and resizing. It takes the screen lock for that. The parser
+ * works in small slices and hands the lock over between two slices whenever
+ * the main thread asks for it, so key presses reach the pty quickly even
+ * during floods.
+ */
+
+#include <cairo.h>
+#include <errno.h>
+#include <glib.h>
+#include <libtsm.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "wlterm.h"
+
+#define PARSE_SLICE 16384
+
+#define SNAP_MASK 0x3
+#define SNAP_FRESH 0x4
+
+struct wlt_parser {
+	struct tsm_screen *screen;
+	struct tsm_vte *vte;
+	struct wlt_reader *reader;
+	GThread *thread;
+	int stop;
+
+	/* main -> parser: capture a snapshot or stop */
+	int kick_fd;
+	/* parser -> main: a snapshot was published */
+	int wake_fd;
+	size_t input;
+
+	/* the screen lock; @want counts main-thread waiters */
+	GMutex screen_lock;
+	GMutex lock;
+	GCond cond;
+	int want;
+
+	struct wlt_snapshot *snaps[3];
+	unsigned int front;
+	unsigned int back;
+	int middle;
+	int dirty;
+	/* the screen may have scrolled since the last capture */
+	bool may_scroll;
+};
+
+static void signal_fd(int fd)
+{
+	uint64_t v = 1;
+
+	if (write(fd, &v, sizeof(v)) < 0) {
+		/* the counter can only overflow if nobody reads it */
+	}
+}
+
+static void clear_fd(int fd)
+{
+	uint64_t v;
+
+	if (read(fd, &v, sizeof(v)) < 0) {
+		/* EAGAIN; nothing pending */
+	}
+}
+
+/* called with the screen lock held */
+static void wlt_parser_publish(struct wlt_parser *parser)
+{
+	int r;
+
+	if (!__atomic_load_n(&parser->dirty, __ATOMIC_SEQ_CST))
+		return;
+	if (__atomic_load_n(&parser->middle, __ATOMIC_SEQ_CST) & SNAP_FRESH)
+		return;
+
+	r = wlt_snapshot_capture(parser->snaps[parser->back], parser->screen,
+				 parser->may_scroll);
+	if (r < 0)
+		return;
+
+	parser->may_scroll = false;
+
+	__atomic_store_n(&parser->dirty, 0, __ATOMIC_SEQ_CST);
+	parser->back = __atomic_exchange_n(&parser->middle,
+					   parser->back | SNAP_FRESH,
+					   __ATOMIC_SEQ_CST) & SNAP_MASK;
+	signal_fd(parser->wake_fd);
+}
+
+/* hand the screen over to the main thread if it is waiting for it */
+static void wlt_parser_yield(struct wlt_parser *parser)
+{
+	if (!__atomic_load_n(&parser->want, __ATOMIC_SEQ_CST))
+		return;
+
+	g_mutex_unlock(&parser->screen_lock);
+	g_mutex_lock(&parser->lock);
+	while (__atomic_load_n(&parser->want, __ATOMIC_SEQ_CST))
+		g_cond_wait(&parser->cond, &parser->lock);
+	g_mutex_unlock(&parser->lock);
+	g_mutex_lock(&parser->screen_lock);
+}
+
+static void wlt_parser_input(const char *u8, size_t len, void *data)
+{
+	struct wlt_parser *parser = data;
+	size_t n;
+
+	__atomic_add_fetch(&parser->input, len, __ATOMIC_RELAXED);
+
+	while (len) {
+		n = len > PARSE_SLICE ? PARSE_SLICE : len;
+		if (wlt_vte_may_scroll(u8, n))
+			parser->may_scroll = true;
+		tsm_vte_input(parser->vte, u8, n);
+		__atomic_store_n(&parser->dirty, 1, __ATOMIC_SEQ_CST);
+		u8 += n;
+		len -= n;
+
+		wlt_parser_publish(parser);
+		wlt_parser_yield(parser);
+	}
+}
+
+static gpointer wlt_parser_run(gpointer data)
+{
+	struct wlt_parser *parser = data;
+	struct pollfd fds[2];
+	int r;
+
+	fds[0].fd = wlt_reader_get_fd(parser->reader);
+	fds[0].events = POLLIN;
+	fds[1].fd = parser->kick_fd;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		r = poll(fds, 2, -1);
+		if (r < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			fprintf(stderr, "ERROR: parser poll failed (%d)\n",
+				-errno);
+			break;
+		}
+
+		if (__atomic_load_n(&parser->stop, __ATOMIC_SEQ_CST))
+			break;
+
+		if (fds[1].revents & POLLIN)
+			clear_fd(parser->kick_fd);
+
+		g_mutex_lock(&parser->screen_lock);
+		if (fds[0].revents & POLLIN)
+			wlt_reader_dispatch(parser->reader, wlt_parser_input,
+					    parser);
+		wlt_parser_publish(parser);
+		g_mutex_unlock(&parser->screen_lock);
+	}
+
+	return NULL;
+}
+
+int wlt_parser_new(struct wlt_parser **out, struct tsm_screen *screen,
+		   struct tsm_vte *vte, struct wlt_reader *reader)
+{
+	struct wlt_parser *parser;
+	int r, i;
+
+	parser = calloc(1, sizeof(*parser));
+	if (!parser)
+		return -ENOMEM;
+	parser->reader = reader;
+	parser->kick_fd = -1;
+	parser->wake_fd = -1;
+	parser->front = 0;
+	parser->middle = 1;
+	parser->back = 2;
+	g_mutex_init(&parser->screen_lock);
+	g_mutex_init(&parser->lock);
+	g_cond_init(&parser->cond);
+
+	for (i = 0; i < 3; ++i) {
+		r = wlt_snapshot_new(&parser->snaps[i]);
+		if (r < 0)
+			goto error;
+	}
+
+	parser->kick_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (parser->kick_fd < 0) {
+		r = -errno;
+		goto error;
+	}
+
+	parser->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (parser->wake_fd < 0) {
+		r = -errno;
+		goto error;
+	}
+
+	tsm_screen_ref(screen);
+	parser->screen = screen;
+	tsm_vte_ref(vte);
+	parser->vte = vte;
+
+	*out = parser;
+	return 0;
+
+error:
+	wlt_parser_free(parser);
+	return r;
+}
+
+void wlt_parser_free(struct wlt_parser *parser)
+{
+	int i;
+
+	if (!parser)
+		return;
+
+	if (parser->thread) {
+		__atomic_store_n(&parser->stop, 1, __ATOMIC_SEQ_CST);
+		signal_fd(parser->kick_fd);
+		g_thread_join(parser->thread);
+	}
+
+	tsm_vte_unref(parser->vte);
+	tsm_screen_unref(parser->screen);
+	if (parser->wake_fd >= 0)
+		close(parser->wake_fd);
+	if (parser->kick_fd >= 0)
+		close(parser->kick_fd);
+	for (i = 0; i < 3; ++i)
+		wlt_snapshot_free(parser->snaps[i]);
+	g_cond_clear(&parser->cond);
+	g_mutex_clear(&parser->lock);
+	g_mutex_clear(&parser->screen_lock);
+	free(parser);
+}
+
+/*
+ * Start parsing. The first snapshot is captured right away, so
+ * wlt_parser_acquire() never returns an empty one. From now on, the screen
+ * and vte must only be touched with the screen lock held.
+ */
+int wlt_parser_start(struct wlt_parser *parser)
+{
+	int r;
+
+	if (parser->thread)
+		return -EALREADY;
+
+	r = wlt_snapshot_capture(parser->snaps[parser->middle],
+				 parser->screen, false);
+	if (r < 0)
+		return r;
+	parser->middle |= SNAP_FRESH;
+
+	parser->thread = g_thread_try_new("wlt-parser", wlt_parser_run, parser,
+					  NULL);
+	if (!parser->thread)
+		return -EAGAIN;
+
+	return 0;
+}
+
+/* the main loop watches this fd for new snapshots */
+int wlt_parser_get_fd(struct wlt_parser *parser)
+{
+	return parser->wake_fd;
+}
+
+/* acknowledge a wakeup; returns the number of bytes parsed since the last
+ * call */
+size_t wlt_parser_dispatch(struct wlt_parser *parser)
+{
+	clear_fd(parser->wake_fd);
+	return __atomic_exchange_n(&parser->input, 0, __ATOMIC_RELAXED);
+}
+
+void wlt_parser_lock(struct wlt_parser *parser)
+{
+	__atomic_add_fetch(&parser->want, 1, __ATOMIC_SEQ_CST);
+	g_mutex_lock(&parser->screen_lock);
+}
+
+/* the screen might have changed, so this also asks for a new snapshot */
+void wlt_parser_unlock(struct wlt_parser *parser)
+{
+	__atomic_store_n(&parser->dirty, 1, __ATOMIC_SEQ_CST);
+	g_mutex_unlock(&parser->screen_lock);
+
+	g_mutex_lock(&parser->lock);
+	__atomic_sub_fetch(&parser->want, 1, __ATOMIC_SEQ_CST);
+	g_cond_broadcast(&parser->cond);
+	g_mutex_unlock(&parser->lock);
+
+	signal_fd(parser->kick_fd);
+}
+
+/* with the screen lock held: the main thread moved the scrollback view */
+void wlt_parser_scrolled(struct wlt_parser *parser)
+{
+	parser->may_scroll = true;
+}
+
+/* get the latest snapshot; it stays valid until the next call */
+struct wlt_snapshot *wlt_parser_acquire(struct wlt_parser *parser)
+{
+	if (__atomic_load_n(&parser->middle, __ATOMIC_SEQ_CST) & SNAP_FRESH) {
+		parser->front = __atomic_exchange_n(&parser->middle,
+						    parser->front,
+						    __ATOMIC_SEQ_CST) &
+				SNAP_MASK;
+
+		/* the parser skipped changes while the slot was taken */
+		if (__atomic_load_n(&parser->dirty, __ATOMIC_SEQ_CST))
+			signal_fd(parser->kick_fd);
+	}
+
+	return parser->snaps[parser->front];
+}
@@ -0,0 +1,205 @@
+/*
+ * wlterm - thread pool
+ *
+ * Copyright (c) 2017 Pamelloes <pamelloes@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Thread Pool
+ * A fixed set of worker threads that run queued jobs in FIFO order. Callers
+ * can either fire-and-forget jobs or wait until all queued jobs of a pool are
+ * done. Each job is told the index of the worker running it, so callers can
+ * keep per-worker state without any locking.
+ */
+
+#include <cairo.h>
+#include <errno.h>
+#include <glib.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "wlterm.h"
+
+struct wlt_job {
+	struct wlt_job *next;
+	wlt_pool_cb cb;
+	void *data;
+};
+
+struct wlt_worker {
+	struct wlt_pool *pool;
+	unsigned int index;
+	GThread *thread;
+};
+
+struct wlt_pool {
+	GMutex lock;
+	GCond work_cond;
+	GCond done_cond;
+	struct wlt_job *first;
+	struct wlt_job *last;
+	unsigned long pending;
+	bool stop;
+
+	unsigned int size;
+	struct wlt_worker *workers;
+};
+
+static gpointer wlt_pool_worker(gpointer data)
+{
+	struct wlt_worker *worker = data;
+	struct wlt_pool *pool = worker->pool;
+	struct wlt_job *job;
+
+	g_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->first && !pool->stop)
+			g_cond_wait(&pool->work_cond, &pool->lock);
+		if (!pool->first)
+			break;
+
+		job = pool->first;
+		pool->first = job->next;
+		if (!pool->first)
+			pool->last = NULL;
+		g_mutex_unlock(&pool->lock);
+
+		job->cb(worker->index, job->data);
+		free(job);
+
+		g_mutex_lock(&pool->lock);
+		if (!--pool->pending)
+			g_cond_broadcast(&pool->done_cond);
+	}
+	g_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+int wlt_pool_new(struct wlt_pool **out, unsigned int threads)
+{
+	struct wlt_pool *pool;
+	struct wlt_worker *w;
+	unsigned int i;
+
+	if (!threads)
+		return -EINVAL;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return -ENOMEM;
+
+	pool->workers = calloc(threads, sizeof(*pool->workers));
+	if (!pool->workers) {
+		free(pool);
+		return -ENOMEM;
+	}
+
+	g_mutex_init(&pool->lock);
+	g_cond_init(&pool->work_cond);
+	g_cond_init(&pool->done_cond);
+
+	for (i = 0; i < threads; ++i) {
+		w = &pool->workers[i];
+		w->pool = pool;
+		w->index = i;
+		w->thread = g_thread_try_new("wlt-worker", wlt_pool_worker, w,
+					     NULL);
+		if (!w->thread)
+			break;
+	}
+
+	/* we can live with fewer threads, but not without any */
+	pool->size = i;
+	if (!pool->size) {
+		wlt_pool_free(pool);
+		return -EAGAIN;
+	}
+
+	*out = pool;
+	return 0;
+}
+
+void wlt_pool_free(struct wlt_pool *pool)
+{
+	struct wlt_job *job;
+	unsigned int i;
+
+	if (!pool)
+		return;
+
+	g_mutex_lock(&pool->lock);
+	pool->stop = true;
+	g_cond_broadcast(&pool->work_cond);
+	g_mutex_unlock(&pool->lock);
+
+	/* workers drain the queue before they exit */
+	for (i = 0; i < pool->size; ++i)
+		g_thread_join(pool->workers[i].thread);
+
+	while ((job = pool->first)) {
+		pool->first = job->next;
+		free(job);
+	}
+
+	g_cond_clear(&pool->done_cond);
+	g_cond_clear(&pool->work_cond);
+	g_mutex_clear(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
+
+unsigned int wlt_pool_get_size(struct wlt_pool *pool)
+{
+	return pool->size;
+}
+
+int wlt_pool_push(struct wlt_pool *pool, wlt_pool_cb cb, void *data)
+{
+	struct wlt_job *job;
+
+	job = malloc(sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+	job->next = NULL;
+	job->cb = cb;
+	job->data = data;
+
+	g_mutex_lock(&pool->lock);
+	if (pool->last)
+		pool->last->next = job;
+	else
+		pool->first = job;
+	pool->last = job;
+	++pool->pending;
+	g_cond_signal(&pool->work_cond);
+	g_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+void wlt_pool_wait(struct wlt_pool *pool)
+{
+	g_mutex_lock(&pool->lock);
+	while (pool->pending)
+		g_cond_wait(&pool->done_cond, &pool->lock);
+	g_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,373 @@
+/*
+ * wlterm - pty reader thread
+ *
+ * Copyright (c) 2017 Pamelloes <pamelloes@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * PTY Reader
+ * If the main loop reads the pty itself, a slow frame delays draining it and
+ * the child blocks on a full kernel buffer. The reader runs the pty bridge on
+ * a thread of its own instead. It owns the pty exclusively: everything read
+ * goes into a single-producer/single-consumer byte ring, and everything the
+ * main thread wants to write is queued and handed over.
+ *
+ * The ring uses free-running head/tail counters and needs no lock. The main
+ * loop watches an eventfd, which is written only when the consumer asked to
+ * be notified, so a flood of small reads costs a single wakeup. If the ring
+ * runs full, the reader blocks until the main loop catches up; only then does
+ * the child see backpressure.
+ */
+
+#include <cairo.h>
+#include <errno.h>
+#include <glib.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "shl_pty.h"
+#include "wlterm.h"
+
+struct wlt_reader {
+	int bridge;
+	struct shl_pty *pty;
+	GThread *thread;
+
+	/* main -> reader: wakes the thread for writes or to stop */
+	int kick_fd;
+	GMutex write_lock;
+	GByteArray *writes;
+
+	/* reader -> main: data is available */
+	int wake_fd;
+	int notified;
+
+	/* ring; only the producer moves @head, only the consumer @tail */
+	char *buf;
+	size_t size;
+	size_t head;
+	size_t tail;
+
+	/* the producer waits for space on @cond */
+	GMutex lock;
+	GCond cond;
+	int waiting;
+	int stop;
+};
+
+static void signal_fd(int fd)
+{
+	uint64_t v = 1;
+
+	if (write(fd, &v, sizeof(v)) < 0) {
+		/* the counter can only overflow if nobody reads it */
+	}
+}
+
+static void clear_fd(int fd)
+{
+	uint64_t v;
+
+	if (read(fd, &v, sizeof(v)) < 0) {
+		/* EAGAIN; nothing pending */
+	}
+}
+
+static void wlt_reader_notify(struct wlt_reader *reader)
+{
+	if (!__atomic_exchange_n(&reader->notified, 1, __ATOMIC_SEQ_CST))
+		signal_fd(reader->wake_fd);
+}
+
+/* returns false if the reader is stopped */
+static bool wlt_reader_wait_space(struct wlt_reader *reader)
+{
+	size_t tail;
+	bool stop;
+
+	g_mutex_lock(&reader->lock);
+	__atomic_store_n(&reader->waiting, 1, __ATOMIC_SEQ_CST);
+	for (;;) {
+		stop = __atomic_load_n(&reader->stop, __ATOMIC_SEQ_CST);
+		tail = __atomic_load_n(&reader->tail, __ATOMIC_SEQ_CST);
+		if (stop || reader->head - tail < reader->size)
+			break;
+		g_cond_wait(&reader->cond, &reader->lock);
+	}
+	__atomic_store_n(&reader->waiting, 0, __ATOMIC_SEQ_CST);
+	g_mutex_unlock(&reader->lock);
+
+	return !stop;
+}
+
+/* producer side; called on the reader thread only */
+void wlt_reader_push(struct wlt_reader *reader, const char *u8, size_t len)
+{
+	size_t head, tail, n, off;
+
+	while (len) {
+		head = reader->head;
+		tail = __atomic_load_n(&reader->tail, __ATOMIC_ACQUIRE);
+		n = reader->size - (head - tail);
+		if (!n) {
+			if (!wlt_reader_wait_space(reader))
+				return;
+			continue;
+		}
+
+		off = head & (reader->size - 1);
+		if (n > reader->size - off)
+			n = reader->size - off;
+		if (n > len)
+			n = len;
+
+		memcpy(&reader->buf[off], u8, n);
+		__atomic_store_n(&reader->head, head + n, __ATOMIC_RELEASE);
+		wlt_reader_notify(reader);
+
+		u8 += n;
+		len -= n;
+	}
+}
+
+static void wlt_reader_consume(struct wlt_reader *reader, size_t len)
+{
+	__atomic_store_n(&reader->tail, reader->tail + len, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&reader->waiting, __ATOMIC_SEQ_CST)) {
+		g_mutex_lock(&reader->lock);
+		g_cond_signal(&reader->cond);
+		g_mutex_unlock(&reader->lock);
+	}
+}
+
+/*
+ * Consumer side; hand everything that is in the ring to @cb. To keep the main
+ * loop responsive under floods, at most one ring worth of data is passed per
+ * call; if more is left, the eventfd is re-armed.
+ */
+void wlt_reader_dispatch(struct wlt_reader *reader, wlt_reader_cb cb,
+			 void *data)
+{
+	size_t head, off, n, total = 0;
+
+	clear_fd(reader->wake_fd);
+	__atomic_store_n(&reader->notified, 0, __ATOMIC_SEQ_CST);
+
+	while (total < reader->size) {
+		head = __atomic_load_n(&reader->head, __ATOMIC_ACQUIRE);
+		n = head - reader->tail;
+		if (!n)
+			return;
+
+		off = reader->tail & (reader->size - 1);
+		if (n > reader->size - off)
+			n = reader->size - off;
+
+		cb(&reader->buf[off], n, data);
+		wlt_reader_consume(reader, n);
+		total += n;
+	}
+
+	if (__atomic_load_n(&reader->head, __ATOMIC_ACQUIRE) != reader->tail)
+		wlt_reader_notify(reader);
+}
+
+/* hand queued writes over to the pty; called on the reader thread only */
+static void wlt_reader_flush(struct wlt_reader *reader)
+{
+	int r = 0;
+
+	g_mutex_lock(&reader->write_lock);
+	if (reader->writes->len) {
+		r = shl_pty_write(reader->pty, (char*)reader->writes->data,
+				  reader->writes->len);
+		g_byte_array_set_size(reader->writes, 0);
+	}
+	g_mutex_unlock(&reader->write_lock);
+
+	if (r < 0)
+		fprintf(stderr, "ERROR: OOM in pty-write (%d)\n", r);
+}
+
+static gpointer wlt_reader_run(gpointer data)
+{
+	struct wlt_reader *reader = data;
+	struct pollfd fds[2];
+	int r;
+
+	fds[0].fd = reader->bridge;
+	fds[0].events = POLLIN;
+	fds[1].fd = reader->kick_fd;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		r = poll(fds, 2, -1);
+		if (r < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			fprintf(stderr, "ERROR: pty reader poll failed (%d)\n",
+				-errno);
+			break;
+		}
+
+		if (__atomic_load_n(&reader->stop, __ATOMIC_SEQ_CST))
+			break;
+
+		if (fds[1].revents & POLLIN) {
+			clear_fd(reader->kick_fd);
+			wlt_reader_flush(reader);
+			shl_pty_dispatch(reader->pty);
+		}
+
+		if (fds[0].revents & POLLIN) {
+			r = shl_pty_bridge_dispatch(reader->bridge, 0);
+			if (r < 0)
+				fprintf(stderr, "ERROR: bridge dispatch "
+					"failed (%d)\n", r);
+		}
+	}
+
+	return NULL;
+}
+
+int wlt_reader_new(struct wlt_reader **out, int bridge, size_t size)
+{
+	struct wlt_reader *reader;
+	int r;
+
+	/* ring indices are masked, so the size must be a power of two */
+	if (!size || (size & (size - 1)))
+		return -EINVAL;
+
+	reader = calloc(1, sizeof(*reader));
+	if (!reader)
+		return -ENOMEM;
+	reader->bridge = bridge;
+	reader->size = size;
+	reader->kick_fd = -1;
+	reader->wake_fd = -1;
+	g_mutex_init(&reader->write_lock);
+	g_mutex_init(&reader->lock);
+	g_cond_init(&reader->cond);
+
+	reader->buf = malloc(size);
+	if (!reader->buf) {
+		r = -ENOMEM;
+		goto error;
+	}
+
+	reader->writes = g_byte_array_new();
+
+	reader->kick_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (reader->kick_fd < 0) {
+		r = -errno;
+		goto error;
+	}
+
+	reader->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (reader->wake_fd < 0) {
+		r = -errno;
+		goto error;
+	}
+
+	*out = reader;
+	return 0;
+
+error:
+	wlt_reader_free(reader);
+	return r;
+}
+
+void wlt_reader_free(struct wlt_reader *reader)
+{
+	if (!reader)
+		return;
+
+	if (reader->thread) {
+		g_mutex_lock(&reader->lock);
+		__atomic_store_n(&reader->stop, 1, __ATOMIC_SEQ_CST);
+		g_cond_signal(&reader->cond);
+		g_mutex_unlock(&reader->lock);
+
+		signal_fd(reader->kick_fd);
+		g_thread_join(reader->thread);
+		shl_pty_unref(reader->pty);
+	}
+
+	if (reader->wake_fd >= 0)
+		close(reader->wake_fd);
+	if (reader->kick_fd >= 0)
+		close(reader->kick_fd);
+	if (reader->writes)
+		g_byte_array_unref(reader->writes);
+	g_cond_clear(&reader->cond);
+	g_mutex_clear(&reader->lock);
+	g_mutex_clear(&reader->write_lock);
+	free(reader->buf);
+	free(reader);
+}
+
+/*
+ * Start draining @pty, which must already be part of the bridge. From now on
+ * the pty must not be read or written by anyone else; use wlt_reader_write().
+ */
+int wlt_reader_start(struct wlt_reader *reader, struct shl_pty *pty)
+{
+	if (reader->thread)
+		return -EALREADY;
+
+	shl_pty_ref(pty);
+	reader->pty = pty;
+	reader->thread = g_thread_try_new("wlt-reader", wlt_reader_run, reader,
+					  NULL);
+	if (!reader->thread) {
+		reader->pty = NULL;
+		shl_pty_unref(pty);
+		return -EAGAIN;
+	}
+
+	return 0;
+}
+
+/* the main loop watches this fd for input */
+int wlt_reader_get_fd(struct wlt_reader *reader)
+{
+	return reader->wake_fd;
+}
+
+int wlt_reader_write(struct wlt_reader *reader, const char *u8, size_t len)
+{
+	if (!reader->thread)
+		return -ENODEV;
+
+	g_mutex_lock(&reader->write_lock);
+	g_byte_array_append(reader->writes, (const guint8*)u8, len);
+	g_mutex_unlock(&reader->write_lock);
+
+	signal_fd(reader->kick_fd);
+	return 0;
+}
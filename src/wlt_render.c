@@ -37,6 +37,8 @@
 #include <string.h>
 #include "wlterm.h"
 
+#define WLT_DAMAGE_MAX 32
+
 struct wlt_renderer {
 	unsigned int width;
 	unsigned int height;
@@ -44,8 +46,344 @@ struct wlt_renderer {
 	uint8_t *data;
 	cairo_surface_t *surface;
 	tsm_age_t age;
+
+	struct wlt_rect damage[WLT_DAMAGE_MAX];
+	size_t n_damage;
+	bool damage_collapsed;
+
+	struct wlt_render_stats stats;
+
+	/* scroll detection */
+	unsigned int rows;
+	unsigned int columns;
+	uint64_t *row_hash;
+	uint64_t *new_hash;
+	bool *row_keep;
+	bool *row_pending;
+	bool *row_redraw;
+	bool scrolled;
+	bool saw_reset;
+	/* the draw pass still has to fill @new_hash */
+	bool hashing;
+
+	/* line positions of the plain face, for the current frame */
+	struct wlt_face_metrics metrics;
+
+	/* parallel rendering; @pool is borrowed from the caller */
+	struct wlt_pool *pool;
+	struct wlt_band *bands;
+	size_t n_bands;
+	struct wlt_op *ops;
+	size_t n_ops;
+	size_t max_ops;
 };
 
+/*
+ * Glyph Blending
+ * Glyphs are stored as A8 coverage masks and blended into the ARGB32 shadow
+ * buffer row by row. The per-pixel math is:
+ *   t = fg * a + bg * (255 - a)
+ *   t += 0x80
+ *   t = (t + (t >> 8)) >> 8
+ * which is an exact, rounded division by 255 for all inputs. It also yields
+ * "bg" for a == 0 and "fg" for a == 255, so the vectorized kernels can run the
+ * formula unconditionally and still produce bit-identical output to the
+ * scalar fallback. All intermediate values fit into 16 bits.
+ *
+ * The kernel is picked once at runtime depending on the CPU features. x86 gets
+ * SSE2 and AVX2 variants, ARM gets NEON if the compiler targets it. Everything
+ * else (and any remainder at the end of a row) uses the scalar path.
+ */
+
+typedef void (*blend_row_fn) (uint32_t *dst, const uint8_t *src,
+			      unsigned int width, uint32_t fc, uint32_t bc);
+
+static void blend_row_scalar(uint32_t *dst, const uint8_t *src,
+			     unsigned int width, uint32_t fc, uint32_t bc)
+{
+	unsigned int i;
+	uint_fast32_t fr, fg, fb, br, bg, bb;
+	uint_fast32_t r, g, b;
+
+	fr = (fc >> 16) & 0xff;
+	fg = (fc >> 8) & 0xff;
+	fb = fc & 0xff;
+	br = (bc >> 16) & 0xff;
+	bg = (bc >> 8) & 0xff;
+	bb = bc & 0xff;
+
+	for (i = 0; i < width; ++i) {
+		if (src[i] == 0) {
+			r = br;
+			g = bg;
+			b = bb;
+		} else if (src[i] == 255) {
+			r = fr;
+			g = fg;
+			b = fb;
+		} else {
+			/* Division by 255 (t /= 255) is done with:
+			 *   t += 0x80
+			 *   t = (t + (t >> 8)) >> 8
+			 * This speeds up the computation by ~20% as
+			 * the division is skipped. */
+			r = fr * src[i] + br * (255 - src[i]);
+			r += 0x80;
+			r = (r + (r >> 8)) >> 8;
+
+			g = fg * src[i] + bg * (255 - src[i]);
+			g += 0x80;
+			g = (g + (g >> 8)) >> 8;
+
+			b = fb * src[i] + bb * (255 - src[i]);
+			b += 0x80;
+			b = (b + (b >> 8)) >> 8;
+		}
+
+		dst[i] = (0xff << 24) | (r << 16) | (g << 8) | b;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+/* blend 8 coverage values (zero-extended to 16bit) into 8 pixels */
+static inline __attribute__((target("sse2")))
+void blend8_sse2(uint32_t *dst, __m128i a,
+		 __m128i fr, __m128i fg, __m128i fb,
+		 __m128i br, __m128i bg, __m128i bb)
+{
+	const __m128i c255 = _mm_set1_epi16(0xff);
+	const __m128i c80 = _mm_set1_epi16(0x80);
+	const __m128i alpha = _mm_set1_epi16((short)0xff00);
+	__m128i inv, r, g, b, gb, ar;
+
+	inv = _mm_sub_epi16(c255, a);
+
+	r = _mm_add_epi16(_mm_mullo_epi16(fr, a), _mm_mullo_epi16(br, inv));
+	r = _mm_add_epi16(r, c80);
+	r = _mm_srli_epi16(_mm_add_epi16(r, _mm_srli_epi16(r, 8)), 8);
+
+	g = _mm_add_epi16(_mm_mullo_epi16(fg, a), _mm_mullo_epi16(bg, inv));
+	g = _mm_add_epi16(g, c80);
+	g = _mm_srli_epi16(_mm_add_epi16(g, _mm_srli_epi16(g, 8)), 8);
+
+	b = _mm_add_epi16(_mm_mullo_epi16(fb, a), _mm_mullo_epi16(bb, inv));
+	b = _mm_add_epi16(b, c80);
+	b = _mm_srli_epi16(_mm_add_epi16(b, _mm_srli_epi16(b, 8)), 8);
+
+	/* low word is G:B, high word is A:R; interleave into ARGB32 */
+	gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+	ar = _mm_or_si128(alpha, r);
+
+	_mm_storeu_si128((__m128i*)dst, _mm_unpacklo_epi16(gb, ar));
+	_mm_storeu_si128((__m128i*)&dst[4], _mm_unpackhi_epi16(gb, ar));
+}
+
+static __attribute__((target("sse2")))
+void blend_row_sse2(uint32_t *dst, const uint8_t *src,
+		    unsigned int width, uint32_t fc, uint32_t bc)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i full = _mm_set1_epi8((char)0xff);
+	__m128i fr, fg, fb, br, bg, bb, v, vf, vb;
+	unsigned int i = 0;
+	int m;
+
+	fr = _mm_set1_epi16((fc >> 16) & 0xff);
+	fg = _mm_set1_epi16((fc >> 8) & 0xff);
+	fb = _mm_set1_epi16(fc & 0xff);
+	br = _mm_set1_epi16((bc >> 16) & 0xff);
+	bg = _mm_set1_epi16((bc >> 8) & 0xff);
+	bb = _mm_set1_epi16(bc & 0xff);
+	vf = _mm_set1_epi32(0xff000000 | fc);
+	vb = _mm_set1_epi32(0xff000000 | bc);
+
+	for ( ; i + 16 <= width; i += 16) {
+		v = _mm_loadu_si128((const __m128i*)&src[i]);
+
+		/* most of a glyph is either empty or fully covered */
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+		if (m == 0xffff) {
+			_mm_storeu_si128((__m128i*)&dst[i], vb);
+			_mm_storeu_si128((__m128i*)&dst[i + 4], vb);
+			_mm_storeu_si128((__m128i*)&dst[i + 8], vb);
+			_mm_storeu_si128((__m128i*)&dst[i + 12], vb);
+			continue;
+		}
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, full));
+		if (m == 0xffff) {
+			_mm_storeu_si128((__m128i*)&dst[i], vf);
+			_mm_storeu_si128((__m128i*)&dst[i + 4], vf);
+			_mm_storeu_si128((__m128i*)&dst[i + 8], vf);
+			_mm_storeu_si128((__m128i*)&dst[i + 12], vf);
+			continue;
+		}
+
+		blend8_sse2(&dst[i], _mm_unpacklo_epi8(v, zero),
+			    fr, fg, fb, br, bg, bb);
+		blend8_sse2(&dst[i + 8], _mm_unpackhi_epi8(v, zero),
+			    fr, fg, fb, br, bg, bb);
+	}
+
+	/* small fonts rarely have 16px wide cells, so do 8px steps, too */
+	if (i + 8 <= width) {
+		v = _mm_loadl_epi64((const __m128i*)&src[i]);
+		blend8_sse2(&dst[i], _mm_unpacklo_epi8(v, zero),
+			    fr, fg, fb, br, bg, bb);
+		i += 8;
+	}
+
+	if (i < width)
+		blend_row_scalar(&dst[i], &src[i], width - i, fc, bc);
+}
+
+/* blend 16 coverage values (zero-extended to 16bit) into 16 pixels */
+static inline __attribute__((target("avx2")))
+void blend16_avx2(uint32_t *dst, __m256i a,
+		  __m256i fr, __m256i fg, __m256i fb,
+		  __m256i br, __m256i bg, __m256i bb)
+{
+	const __m256i c255 = _mm256_set1_epi16(0xff);
+	const __m256i c80 = _mm256_set1_epi16(0x80);
+	const __m256i alpha = _mm256_set1_epi16((short)0xff00);
+	__m256i inv, r, g, b, gb, ar, lo, hi;
+
+	inv = _mm256_sub_epi16(c255, a);
+
+	r = _mm256_add_epi16(_mm256_mullo_epi16(fr, a),
+			     _mm256_mullo_epi16(br, inv));
+	r = _mm256_add_epi16(r, c80);
+	r = _mm256_srli_epi16(_mm256_add_epi16(r, _mm256_srli_epi16(r, 8)), 8);
+
+	g = _mm256_add_epi16(_mm256_mullo_epi16(fg, a),
+			     _mm256_mullo_epi16(bg, inv));
+	g = _mm256_add_epi16(g, c80);
+	g = _mm256_srli_epi16(_mm256_add_epi16(g, _mm256_srli_epi16(g, 8)), 8);
+
+	b = _mm256_add_epi16(_mm256_mullo_epi16(fb, a),
+			     _mm256_mullo_epi16(bb, inv));
+	b = _mm256_add_epi16(b, c80);
+	b = _mm256_srli_epi16(_mm256_add_epi16(b, _mm256_srli_epi16(b, 8)), 8);
+
+	gb = _mm256_or_si256(_mm256_slli_epi16(g, 8), b);
+	ar = _mm256_or_si256(alpha, r);
+
+	/* unpack works per 128bit lane: lo = px 0-3 + 8-11, hi = 4-7 + 12-15 */
+	lo = _mm256_unpacklo_epi16(gb, ar);
+	hi = _mm256_unpackhi_epi16(gb, ar);
+
+	_mm256_storeu_si256((__m256i*)dst, _mm256_permute2x128_si256(lo, hi,
+								     0x20));
+	_mm256_storeu_si256((__m256i*)&dst[8],
+			    _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+static __attribute__((target("avx2")))
+void blend_row_avx2(uint32_t *dst, const uint8_t *src,
+		    unsigned int width, uint32_t fc, uint32_t bc)
+{
+	__m256i fr, fg, fb, br, bg, bb;
+	unsigned int i = 0;
+
+	fr = _mm256_set1_epi16((fc >> 16) & 0xff);
+	fg = _mm256_set1_epi16((fc >> 8) & 0xff);
+	fb = _mm256_set1_epi16(fc & 0xff);
+	br = _mm256_set1_epi16((bc >> 16) & 0xff);
+	bg = _mm256_set1_epi16((bc >> 8) & 0xff);
+	bb = _mm256_set1_epi16(bc & 0xff);
+
+	for ( ; i + 32 <= width; i += 32) {
+		blend16_avx2(&dst[i], _mm256_cvtepu8_epi16(
+				_mm_loadu_si128((const __m128i*)&src[i])),
+			     fr, fg, fb, br, bg, bb);
+		blend16_avx2(&dst[i + 16], _mm256_cvtepu8_epi16(
+				_mm_loadu_si128((const __m128i*)&src[i + 16])),
+			     fr, fg, fb, br, bg, bb);
+	}
+
+	if (i + 16 <= width) {
+		blend16_avx2(&dst[i], _mm256_cvtepu8_epi16(
+				_mm_loadu_si128((const __m128i*)&src[i])),
+			     fr, fg, fb, br, bg, bb);
+		i += 16;
+	}
+
+	if (i < width)
+		blend_row_sse2(&dst[i], &src[i], width - i, fc, bc);
+}
+
+static blend_row_fn blend_row_select(void)
+{
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		return blend_row_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return blend_row_sse2;
+
+	return blend_row_scalar;
+}
+
+#elif defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+#include <arm_neon.h>
+
+static void blend_row_neon(uint32_t *dst, const uint8_t *src,
+			   unsigned int width, uint32_t fc, uint32_t bc)
+{
+	uint8x8_t fr, fg, fb, br, bg, bb, a, inv;
+	uint16x8_t r, g, b, c80;
+	uint8x8x4_t px;
+	unsigned int i;
+
+	fr = vdup_n_u8((fc >> 16) & 0xff);
+	fg = vdup_n_u8((fc >> 8) & 0xff);
+	fb = vdup_n_u8(fc & 0xff);
+	br = vdup_n_u8((bc >> 16) & 0xff);
+	bg = vdup_n_u8((bc >> 8) & 0xff);
+	bb = vdup_n_u8(bc & 0xff);
+	c80 = vdupq_n_u16(0x80);
+	px.val[3] = vdup_n_u8(0xff);
+
+	for (i = 0; i + 8 <= width; i += 8) {
+		a = vld1_u8(&src[i]);
+		inv = vmvn_u8(a);
+
+		r = vaddq_u16(vmlal_u8(vmull_u8(fr, a), br, inv), c80);
+		g = vaddq_u16(vmlal_u8(vmull_u8(fg, a), bg, inv), c80);
+		b = vaddq_u16(vmlal_u8(vmull_u8(fb, a), bb, inv), c80);
+
+		/* (t + (t >> 8)) >> 8, narrowed to 8bit */
+		px.val[2] = vshrn_n_u16(vsraq_n_u16(r, r, 8), 8);
+		px.val[1] = vshrn_n_u16(vsraq_n_u16(g, g, 8), 8);
+		px.val[0] = vshrn_n_u16(vsraq_n_u16(b, b, 8), 8);
+
+		/* ARGB32 is stored as B, G, R, A bytes on little-endian */
+		vst4_u8((uint8_t*)&dst[i], px);
+	}
+
+	if (i < width)
+		blend_row_scalar(&dst[i], &src[i], width - i, fc, bc);
+}
+
+static blend_row_fn blend_row_select(void)
+{
+	return blend_row_neon;
+}
+
+#else
+
+static blend_row_fn blend_row_select(void)
+{
+	return blend_row_scalar;
+}
+
+#endif
+
+static blend_row_fn blend_row;
+
 static int wlt_renderer_realloc(struct wlt_renderer *rend, unsigned int width,
 				unsigned int height)
 {
@@ -89,6 +427,9 @@ int wlt_renderer_new(struct wlt_renderer **out, unsigned int width,
 	struct wlt_renderer *rend;
 	int r;
 
+	if (!blend_row)
+		blend_row = blend_row_select();
+
 	rend = calloc(1, sizeof(*rend));
 	if (!rend)
 		return -ENOMEM;
@@ -110,7 +451,14 @@ void wlt_renderer_free(struct wlt_renderer *rend)
 	if (!rend)
 		return;
 
+	free(rend->bands);
+	free(rend->ops);
 	cairo_surface_destroy(rend->surface);
+	free(rend->row_redraw);
+	free(rend->row_pending);
+	free(rend->row_keep);
+	free(rend->new_hash);
+	free(rend->row_hash);
 	free(rend->data);
 	free(rend);
 }
@@ -126,10 +474,131 @@ void wlt_renderer_dirty(struct wlt_renderer *rend)
 	rend->age = 0;
 }
 
+/*
+ * Damage Tracking
+ * Every pixel-rectangle we write into the shadow buffer is recorded so the
+ * caller can invalidate and repaint only those regions. Cells are drawn row by
+ * row, so adjacent cells are merged into horizontal spans on insertion. Once
+ * a frame is done, spans with equal horizontal extents are merged vertically.
+ * If we run out of slots, we collapse everything into the bounding box; at
+ * that point most of the screen changed anyway.
+ */
+
+static void rect_union(struct wlt_rect *r, unsigned int x, unsigned int y,
+		       unsigned int width, unsigned int height)
+{
+	unsigned int x2, y2;
+
+	x2 = r->x + r->width;
+	y2 = r->y + r->height;
+	if (x + width > x2)
+		x2 = x + width;
+	if (y + height > y2)
+		y2 = y + height;
+	if (x < r->x)
+		r->x = x;
+	if (y < r->y)
+		r->y = y;
+
+	r->width = x2 - r->x;
+	r->height = y2 - r->y;
+}
+
+static void wlt_renderer_damage(struct wlt_renderer *rend,
+				unsigned int x, unsigned int y,
+				unsigned int width, unsigned int height)
+{
+	struct wlt_rect *r;
+	size_t i;
+
+	/* clip to buffer */
+	if (x >= rend->width || y >= rend->height || !width || !height)
+		return;
+	if (x + width > rend->width)
+		width = rend->width - x;
+	if (y + height > rend->height)
+		height = rend->height - y;
+
+	if (rend->n_damage) {
+		r = &rend->damage[rend->n_damage - 1];
+
+		if (rend->damage_collapsed) {
+			rect_union(r, x, y, width, height);
+			return;
+		}
+
+		/* extend the current span if the cell is right next to it */
+		if (r->y == y && r->height == height &&
+		    r->x + r->width == x) {
+			r->width += width;
+			return;
+		}
+	}
+
+	if (rend->n_damage >= WLT_DAMAGE_MAX) {
+		r = &rend->damage[0];
+		for (i = 1; i < rend->n_damage; ++i)
+			rect_union(r, rend->damage[i].x, rend->damage[i].y,
+				   rend->damage[i].width,
+				   rend->damage[i].height);
+		rect_union(r, x, y, width, height);
+		rend->n_damage = 1;
+		rend->damage_collapsed = true;
+		return;
+	}
+
+	r = &rend->damage[rend->n_damage++];
+	r->x = x;
+	r->y = y;
+	r->width = width;
+	r->height = height;
+}
+
+static void wlt_renderer_merge_damage(struct wlt_renderer *rend)
+{
+	struct wlt_rect *a, *b;
+	size_t i, j;
+
+	for (i = 0; i < rend->n_damage; ++i) {
+		a = &rend->damage[i];
+		for (j = i + 1; j < rend->n_damage; ) {
+			b = &rend->damage[j];
+			if (a->x == b->x && a->width == b->width &&
+			    a->y + a->height == b->y) {
+				a->height += b->height;
+				memmove(b, b + 1, (rend->n_damage - j - 1) *
+						  sizeof(*b));
+				--rend->n_damage;
+			} else {
+				++j;
+			}
+		}
+	}
+}
+
+/* the shadow buffer; up-to-date after each wlt_renderer_update() */
+cairo_surface_t *wlt_renderer_get_surface(struct wlt_renderer *rend)
+{
+	return rend->surface;
+}
+
+void wlt_renderer_get_stats(struct wlt_renderer *rend,
+			    struct wlt_render_stats *out)
+{
+	*out = rend->stats;
+}
+
+size_t wlt_renderer_get_damage(struct wlt_renderer *rend,
+			       const struct wlt_rect **out)
+{
+	*out = rend->damage;
+	return rend->n_damage;
+}
+
 static void wlt_renderer_fill(struct wlt_renderer *rend,
 			      unsigned int x, unsigned int y,
 			      unsigned int width, unsigned int height,
-			      uint8_t br, uint8_t bg, uint8_t bb)
+			      uint32_t bc)
 {
 	unsigned int i, tmp;
 	uint8_t *dst;
@@ -152,7 +621,7 @@ static void wlt_renderer_fill(struct wlt_renderer *rend,
 	/* prepare */
 	dst = rend->data;
 	dst = &dst[y * rend->stride + x * 4];
-	out = (0xff << 24) | (br << 16) | (bg << 8) | bb;
+	out = (0xff << 24) | bc;
 
 	/* fill buffer */
 	while (height--) {
@@ -208,32 +677,33 @@ static void wlt_renderer_highlight(struct wlt_renderer *rend,
 static void wlt_renderer_blend(struct wlt_renderer *rend,
 			       const struct wlt_glyph *glyph,
 			       unsigned int x, unsigned int y,
-			       uint8_t fr, uint8_t fg, uint8_t fb,
-			       uint8_t br, uint8_t bg, uint8_t bb)
+			       unsigned int max_width,
+			       unsigned int max_height,
+			       uint32_t fc, uint32_t bc)
 {
-	unsigned int i, tmp, width, height;
+	unsigned int tmp, width, height;
 	const uint8_t *src;
 	uint8_t *dst;
-	uint32_t out;
-	uint_fast32_t r, g, b;
 
-	/* clip width */
-	tmp = x + glyph->width;
+	/* clip width; glyphs must never leak into the next cell */
+	width = glyph->width;
+	if (width > max_width)
+		width = max_width;
+	tmp = x + width;
 	if (tmp <= x || x >= rend->width)
 		return;
 	if (tmp > rend->width)
 		width = rend->width - x;
-	else
-		width = glyph->width;
 
-	/* clip height */
-	tmp = y + glyph->height;
+	/* clip height; glyphs must never leak into the next cell-row */
+	height = glyph->height;
+	if (height > max_height)
+		height = max_height;
+	tmp = y + height;
 	if (tmp <= y || y >= rend->height)
 		return;
 	if (tmp > rend->height)
 		height = rend->height - y;
-	else
-		height = glyph->height;
 
 	/* prepare */
 	dst = rend->data;
@@ -242,41 +712,701 @@ static void wlt_renderer_blend(struct wlt_renderer *rend,
 
 	/* blend buffer */
 	while (height--) {
-		for (i = 0; i < width; ++i) {
-			if (src[i] == 0) {
-				r = br;
-				g = bg;
-				b = bb;
-			} else if (src[i] == 255) {
-				r = fr;
-				g = fg;
-				b = fb;
-			} else {
-				/* Division by 255 (t /= 255) is done with:
-				 *   t += 0x80
-				 *   t = (t + (t >> 8)) >> 8
-				 * This speeds up the computation by ~20% as
-				 * the division is skipped. */
-				r = fr * src[i] + br * (255 - src[i]);
-				r += 0x80;
-				r = (r + (r >> 8)) >> 8;
-
-				g = fg * src[i] + bg * (255 - src[i]);
-				g += 0x80;
-				g = (g + (g >> 8)) >> 8;
-
-				b = fb * src[i] + bb * (255 - src[i]);
-				b += 0x80;
-				b = (b + (b >> 8)) >> 8;
-			}
+		blend_row((uint32_t*)dst, src, width, fc, bc);
 
-			out = (0xff << 24) | (r << 16) | (g << 8) | b;
-			((uint32_t*)dst)[i] = out;
-		}
+		dst += rend->stride;
+		src += glyph->stride;
+	}
+}
+
+static void wlt_renderer_copy(struct wlt_renderer *rend,
+			      const struct wlt_color_glyph *cg,
+			      unsigned int x, unsigned int y,
+			      unsigned int max_width)
+{
+	unsigned int tmp, width, height;
+	const uint32_t *src;
+	uint8_t *dst;
+
+	/* clip width */
+	width = cg->width;
+	if (width > max_width)
+		width = max_width;
+	tmp = x + width;
+	if (tmp <= x || x >= rend->width)
+		return;
+	if (tmp > rend->width)
+		width = rend->width - x;
+
+	/* clip height */
+	height = cg->height;
+	tmp = y + height;
+	if (tmp <= y || y >= rend->height)
+		return;
+	if (tmp > rend->height)
+		height = rend->height - y;
+
+	/* prepare */
+	dst = rend->data;
+	dst = &dst[y * rend->stride + x * 4];
+	src = cg->buffer;
+
+	/* copy buffer */
+	while (height--) {
+		memcpy(dst, src, width * 4);
 
 		dst += rend->stride;
+		src += cg->width;
+	}
+}
+
+/* blend @glyph into the yet empty pre-colored entry @cg */
+static void wlt_renderer_fill_color(struct wlt_color_glyph *cg,
+				    const struct wlt_glyph *glyph)
+{
+	const uint8_t *src = glyph->buffer;
+	uint32_t *dst = cg->buffer;
+	unsigned int i;
+
+	for (i = 0; i < cg->height; ++i) {
+		blend_row(dst, src, cg->width, cg->fc, cg->bc);
+
+		dst += cg->width;
 		src += glyph->stride;
 	}
+
+	cg->ready = true;
+}
+
+/*
+ * Cell Operations
+ * Drawing a cell boils down to either filling it with the background or
+ * blending a glyph into it, plus an optional debug highlight. In parallel
+ * mode, the screen traversal (which needs the glyph-cache and thus must run
+ * on the main thread) only records these operations. They are then split
+ * into bands of whole cell-rows and executed by the worker pool. As bands
+ * never share a cell-row, workers write to disjoint parts of the buffer.
+ */
+
+struct wlt_op {
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+	const struct wlt_glyph *glyph;
+	struct wlt_color_glyph *colored;
+	uint32_t fc;
+	uint32_t bc;
+	bool underline;
+	bool highlight;
+};
+
+struct wlt_band {
+	struct wlt_renderer *rend;
+	size_t begin;
+	size_t end;
+};
+
+/*
+ * The underline is a solid span in the foreground color on top of the cell,
+ * so underlined text shares glyphs and pre-colored cells with plain text.
+ */
+static void wlt_renderer_underline(struct wlt_renderer *rend,
+				   const struct wlt_op *op)
+{
+	const struct wlt_face_metrics *m = &rend->metrics;
+
+	wlt_renderer_fill(rend, op->x, op->y + m->underline_pos, op->width,
+			  m->underline_size, op->fc);
+}
+
+/* below this, waking up the workers costs more than it saves */
+#define WLT_PARALLEL_MIN_OPS 256
+
+static void wlt_renderer_exec_op(struct wlt_renderer *rend,
+				 const struct wlt_op *op)
+{
+	if (op->colored) {
+		if (!op->colored->ready)
+			wlt_renderer_fill_color(op->colored, op->glyph);
+		wlt_renderer_copy(rend, op->colored, op->x, op->y,
+				  op->width);
+	} else if (op->glyph)
+		wlt_renderer_blend(rend, op->glyph, op->x, op->y, op->width,
+				   op->height, op->fc, op->bc);
+	else
+		wlt_renderer_fill(rend, op->x, op->y, op->width, op->height,
+				  op->bc);
+
+	if (op->underline)
+		wlt_renderer_underline(rend, op);
+
+	if (op->highlight)
+		wlt_renderer_highlight(rend, op->x, op->y, op->width,
+				       op->height);
+}
+
+static int wlt_renderer_push_op(struct wlt_renderer *rend,
+				const struct wlt_op *op)
+{
+	struct wlt_op *ops;
+	size_t n;
+
+	if (rend->n_ops >= rend->max_ops) {
+		n = rend->max_ops ? rend->max_ops * 2 : 1024;
+		ops = realloc(rend->ops, n * sizeof(*ops));
+		if (!ops)
+			return -ENOMEM;
+
+		rend->ops = ops;
+		rend->max_ops = n;
+	}
+
+	rend->ops[rend->n_ops++] = *op;
+	return 0;
+}
+
+static void wlt_renderer_band_cb(unsigned int worker, void *data)
+{
+	struct wlt_band *band = data;
+	size_t i;
+
+	for (i = band->begin; i < band->end; ++i)
+		wlt_renderer_exec_op(band->rend, &band->rend->ops[i]);
+}
+
+static void wlt_renderer_run_ops(struct wlt_renderer *rend)
+{
+	struct wlt_band *band;
+	size_t i, n, per, begin, end;
+	int r;
+
+	if (rend->n_ops < WLT_PARALLEL_MIN_OPS) {
+		for (i = 0; i < rend->n_ops; ++i)
+			wlt_renderer_exec_op(rend, &rend->ops[i]);
+		rend->n_ops = 0;
+		return;
+	}
+
+	/* Split the operations into roughly equally sized bands. Ops are
+	 * recorded in screen order, so we only need to move each split point
+	 * forward to the next cell-row. The main thread takes one band, too. */
+	per = rend->n_ops / rend->n_bands;
+	begin = 0;
+	for (n = 0; n < rend->n_bands && begin < rend->n_ops; ++n) {
+		end = begin + per;
+		if (n + 1 == rend->n_bands || end >= rend->n_ops) {
+			end = rend->n_ops;
+		} else {
+			while (end < rend->n_ops &&
+			       rend->ops[end].y == rend->ops[end - 1].y)
+				++end;
+		}
+
+		band = &rend->bands[n];
+		band->rend = rend;
+		band->begin = begin;
+		band->end = end;
+		begin = end;
+	}
+
+	for (i = 1; i < n; ++i) {
+		r = wlt_pool_push(rend->pool, wlt_renderer_band_cb,
+				  &rend->bands[i]);
+		if (r < 0)
+			wlt_renderer_band_cb(0, &rend->bands[i]);
+	}
+
+	wlt_renderer_band_cb(0, &rend->bands[0]);
+	wlt_pool_wait(rend->pool);
+	rend->n_ops = 0;
+}
+
+/*
+ * Render in parallel on @pool, or on the calling thread only if it is NULL.
+ * The pool can be shared by all renderers of the main thread, as each one
+ * waits for its bands before returning. It must outlive the renderer.
+ */
+int wlt_renderer_set_pool(struct wlt_renderer *rend, struct wlt_pool *pool)
+{
+	struct wlt_band *bands = NULL;
+
+	if (pool) {
+		bands = calloc(wlt_pool_get_size(pool) + 1, sizeof(*bands));
+		if (!bands)
+			return -ENOMEM;
+	}
+
+	free(rend->bands);
+	rend->pool = pool;
+	rend->bands = bands;
+	rend->n_bands = pool ? wlt_pool_get_size(pool) + 1 : 0;
+
+	return 0;
+}
+
+/*
+ * Snapshots
+ * If the screen is parsed on another thread, the renderer must not walk the
+ * live tsm_screen. Instead, the parser captures a snapshot of all visible
+ * cells at a point of its choosing, and the renderer replays it through the
+ * same callbacks tsm_screen_draw() would invoke. Cell ages are kept, so
+ * drawing consecutive snapshots skips unchanged cells exactly like drawing
+ * the screen itself. Buffers are reused across captures.
+ */
+
+struct wlt_snap_cell {
+	uint32_t id;
+	uint32_t ch;
+	uint16_t len;
+	uint16_t cwidth;
+	uint16_t posx;
+	uint16_t posy;
+	tsm_age_t age;
+	struct tsm_screen_attr attr;
+};
+
+struct wlt_snapshot {
+	unsigned int width;
+	unsigned int height;
+	tsm_age_t age;
+	bool failed;
+	bool may_scroll;
+
+	struct wlt_snap_cell *cells;
+	size_t n_cells;
+	size_t max_cells;
+	uint32_t *chars;
+	size_t n_chars;
+	size_t max_chars;
+};
+
+int wlt_snapshot_new(struct wlt_snapshot **out)
+{
+	struct wlt_snapshot *snap;
+
+	snap = calloc(1, sizeof(*snap));
+	if (!snap)
+		return -ENOMEM;
+
+	*out = snap;
+	return 0;
+}
+
+void wlt_snapshot_free(struct wlt_snapshot *snap)
+{
+	if (!snap)
+		return;
+
+	free(snap->chars);
+	free(snap->cells);
+	free(snap);
+}
+
+static bool snap_grow(void **buf, size_t *max, size_t need, size_t size)
+{
+	size_t n;
+	void *t;
+
+	if (need <= *max)
+		return true;
+
+	n = *max ? *max : 1024;
+	while (n < need)
+		n *= 2;
+
+	t = realloc(*buf, n * size);
+	if (!t)
+		return false;
+
+	*buf = t;
+	*max = n;
+	return true;
+}
+
+static int wlt_snapshot_add(struct tsm_screen *screen, uint32_t id,
+			    const uint32_t *ch, size_t len,
+			    unsigned int cwidth, unsigned int posx,
+			    unsigned int posy,
+			    const struct tsm_screen_attr *attr,
+			    tsm_age_t age, void *data)
+{
+	struct wlt_snapshot *snap = data;
+	struct wlt_snap_cell *c;
+
+	if (!snap_grow((void**)&snap->cells, &snap->max_cells,
+		       snap->n_cells + 1, sizeof(*snap->cells)) ||
+	    !snap_grow((void**)&snap->chars, &snap->max_chars,
+		       snap->n_chars + len, sizeof(*snap->chars))) {
+		snap->failed = true;
+		return 0;
+	}
+
+	c = &snap->cells[snap->n_cells++];
+	c->id = id;
+	c->ch = snap->n_chars;
+	c->len = len;
+	c->cwidth = cwidth;
+	c->posx = posx;
+	c->posy = posy;
+	c->age = age;
+	c->attr = *attr;
+
+	if (len)
+		memcpy(&snap->chars[snap->n_chars], ch, len * sizeof(*ch));
+	snap->n_chars += len;
+
+	return 0;
+}
+
+/*
+ * The caller must own @screen exclusively while this runs. @may_scroll tells
+ * the renderer whether the screen may have scrolled since the last capture.
+ */
+int wlt_snapshot_capture(struct wlt_snapshot *snap, struct tsm_screen *screen,
+			 bool may_scroll)
+{
+	snap->n_cells = 0;
+	snap->n_chars = 0;
+	snap->failed = false;
+	snap->may_scroll = may_scroll;
+	snap->width = tsm_screen_get_width(screen);
+	snap->height = tsm_screen_get_height(screen);
+	snap->age = tsm_screen_draw(screen, wlt_snapshot_add, snap);
+
+	/* a partial snapshot would be taken for unchanged cells later on */
+	if (snap->failed) {
+		snap->n_cells = 0;
+		snap->age = 0;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static tsm_age_t wlt_snapshot_draw(struct wlt_snapshot *snap,
+				   tsm_screen_draw_cb cb, void *data)
+{
+	const struct wlt_snap_cell *c;
+	size_t i;
+
+	for (i = 0; i < snap->n_cells; ++i) {
+		c = &snap->cells[i];
+		cb(NULL, c->id, &snap->chars[c->ch], c->len, c->cwidth,
+		   c->posx, c->posy, &c->attr, c->age, data);
+	}
+
+	return snap->age;
+}
+
+/* draw either the snapshot of @ctx or, if there is none, its screen */
+static tsm_age_t ctx_draw(const struct wlt_draw_ctx *ctx,
+			  tsm_screen_draw_cb cb, void *data)
+{
+	if (ctx->snap)
+		return wlt_snapshot_draw(ctx->snap, cb, data);
+
+	return tsm_screen_draw(ctx->screen, cb, data);
+}
+
+static unsigned int ctx_columns(const struct wlt_draw_ctx *ctx)
+{
+	if (ctx->snap)
+		return ctx->snap->width;
+
+	return tsm_screen_get_width(ctx->screen);
+}
+
+static unsigned int ctx_rows(const struct wlt_draw_ctx *ctx)
+{
+	if (ctx->snap)
+		return ctx->snap->height;
+
+	return tsm_screen_get_height(ctx->screen);
+}
+
+/*
+ * Scroll Detection
+ * When output scrolls, every cell gets a new age even though most of the
+ * screen just moved by a few rows. Each row gets a hash, which the draw pass
+ * computes as it goes. If the caller or the snapshot says the screen may have
+ * scrolled since the last frame, we walk the screen (or the snapshot, if the
+ * screen is parsed on another thread) once before drawing to get the hashes
+ * early. Comparing them against those of the previous frame tells us whether
+ * the content was shifted. If so, we move the pixels in the shadow buffer and
+ * only redraw rows that don't match their shifted counterpart. Output that
+ * can't scroll, like echoed keystrokes, skips the extra walk.
+ */
+
+static bool ctx_may_scroll(const struct wlt_draw_ctx *ctx)
+{
+	return ctx->may_scroll || (ctx->snap && ctx->snap->may_scroll);
+}
+
+/*
+ * Whether feeding @u8 into a vte might scroll the screen. Apart from
+ * wrapping at the bottom right, only line feeds and escape sequences (in
+ * their 7-bit or C1 form) can do that. Plain echoed text never contains
+ * them, so it doesn't pay for scroll detection.
+ */
+bool wlt_vte_may_scroll(const char *u8, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		switch ((unsigned char)u8[i]) {
+		case '\n':
+		case '\v':
+		case '\f':
+		case 0x1b:	/* ESC */
+		case 0x84:	/* IND */
+		case 0x85:	/* NEL */
+		case 0x8d:	/* RI */
+		case 0x9b:	/* CSI */
+			return true;
+		}
+	}
+
+	return false;
+}
+
+#define ROW_HASH_INIT 0xcbf29ce484222325ULL
+#define ROW_HASH_PRIME 0x100000001b3ULL
+
+static inline uint64_t row_hash_add(uint64_t h, uint64_t v)
+{
+	return (h ^ v) * ROW_HASH_PRIME;
+}
+
+static void row_hash_cell(struct wlt_renderer *rend, uint32_t id,
+			  size_t len, unsigned int cwidth, unsigned int posx,
+			  unsigned int posy, const struct tsm_screen_attr *attr)
+{
+	uint64_t h, v;
+
+	if (posy >= rend->rows)
+		return;
+
+	v = attr->bold | attr->italic << 1 | attr->underline << 2 |
+	    attr->inverse << 3 | attr->blink << 4 | attr->selection << 5 |
+	    attr->cursor << 6;
+
+	h = rend->new_hash[posy];
+	h = row_hash_add(h, len ? id : 0);
+	h = row_hash_add(h, (uint64_t)posx << 32 | cwidth << 8 | v);
+	h = row_hash_add(h, (uint64_t)attr->fr << 40 | (uint64_t)attr->fg << 32 |
+			    (uint64_t)attr->fb << 24 | attr->br << 16 |
+			    attr->bg << 8 | attr->bb);
+	rend->new_hash[posy] = h;
+}
+
+static int wlt_renderer_hash_cell(struct tsm_screen *screen, uint32_t id,
+				  const uint32_t *ch, size_t len,
+				  unsigned int cwidth, unsigned int posx,
+				  unsigned int posy,
+				  const struct tsm_screen_attr *attr,
+				  tsm_age_t age, void *data)
+{
+	struct wlt_renderer *rend = data;
+
+	if (!age)
+		rend->saw_reset = true;
+	row_hash_cell(rend, id, len, cwidth, posx, posy, attr);
+
+	return 0;
+}
+
+static int wlt_renderer_prepare_rows(struct wlt_renderer *rend,
+				     unsigned int rows, unsigned int columns)
+{
+	uint64_t *row_hash, *new_hash;
+	bool *row_keep, *row_pending, *row_redraw;
+
+	if (rows == rend->rows && columns == rend->columns)
+		return 0;
+
+	row_hash = calloc(rows, sizeof(*row_hash));
+	new_hash = calloc(rows, sizeof(*new_hash));
+	row_keep = calloc(rows, sizeof(*row_keep));
+	row_pending = calloc(rows, sizeof(*row_pending));
+	row_redraw = calloc(rows, sizeof(*row_redraw));
+	if (!row_hash || !new_hash || !row_keep || !row_pending ||
+	    !row_redraw) {
+		free(row_redraw);
+		free(row_pending);
+		free(row_keep);
+		free(new_hash);
+		free(row_hash);
+		return -ENOMEM;
+	}
+
+	free(rend->row_redraw);
+	free(rend->row_pending);
+	free(rend->row_keep);
+	free(rend->new_hash);
+	free(rend->row_hash);
+	rend->row_hash = row_hash;
+	rend->new_hash = new_hash;
+	rend->row_keep = row_keep;
+	rend->row_pending = row_pending;
+	rend->row_redraw = row_redraw;
+	rend->rows = rows;
+	rend->columns = columns;
+
+	/* previous hashes don't describe the shadow buffer anymore */
+	rend->age = 0;
+
+	return 0;
+}
+
+/* count rows that are in place if the old content is shifted by @d rows */
+static unsigned int count_matches(struct wlt_renderer *rend, int d)
+{
+	unsigned int i, n = 0;
+	int j;
+
+	for (i = 0; i < rend->rows; ++i) {
+		j = (int)i + d;
+		if (j >= 0 && j < (int)rend->rows &&
+		    rend->new_hash[i] == rend->row_hash[j])
+			++n;
+	}
+
+	return n;
+}
+
+static void wlt_renderer_scroll(struct wlt_renderer *rend,
+				unsigned int cell_height, int d)
+{
+	size_t line, len;
+	uint8_t *data = rend->data;
+	struct wlt_rect *r;
+
+	line = (size_t)cell_height * rend->stride;
+	len = (rend->rows - abs(d)) * line;
+
+	if (d > 0)
+		memmove(data, &data[d * line], len);
+	else
+		memmove(&data[-d * line], data, len);
+
+	/* the whole grid moved; everything drawn afterwards is inside it */
+	r = &rend->damage[0];
+	r->x = 0;
+	r->y = 0;
+	r->width = rend->width;
+	r->height = rend->rows * cell_height;
+	rend->n_damage = 1;
+	rend->damage_collapsed = true;
+}
+
+/*
+ * Reset the per-row state for a new frame. The row hashes are filled in while
+ * drawing, so they always describe the shadow buffer without a second pass.
+ */
+static int wlt_renderer_begin_rows(struct wlt_renderer *rend,
+				   const struct wlt_draw_ctx *ctx)
+{
+	unsigned int i;
+	bool *p;
+	int r;
+
+	rend->scrolled = false;
+	rend->hashing = false;
+
+	r = wlt_renderer_prepare_rows(rend, ctx_rows(ctx), ctx_columns(ctx));
+	if (r < 0)
+		return r;
+
+	/* rows that showed glyphs still being rasterized must be redrawn */
+	p = rend->row_redraw;
+	rend->row_redraw = rend->row_pending;
+	rend->row_pending = p;
+
+	for (i = 0; i < rend->rows; ++i) {
+		rend->new_hash[i] = ROW_HASH_INIT;
+		rend->row_keep[i] = false;
+		rend->row_pending[i] = false;
+	}
+
+	rend->hashing = true;
+
+	return 0;
+}
+
+static void wlt_renderer_end_rows(struct wlt_renderer *rend)
+{
+	uint64_t *t;
+
+	t = rend->row_hash;
+	rend->row_hash = rend->new_hash;
+	rend->new_hash = t;
+	rend->hashing = false;
+}
+
+/*
+ * Hash all rows of the screen and, if the content scrolled, shift the shadow
+ * buffer accordingly. This also marks which rows are already in place. It
+ * costs a full pass over the screen, so it only runs if the caller says the
+ * screen may have scrolled.
+ */
+static void wlt_renderer_detect_scroll(struct wlt_renderer *rend,
+				       const struct wlt_draw_ctx *ctx)
+{
+	unsigned int i, rows, n, best_n, base_n;
+	int d, best_d;
+
+	/* previous hashes are only meaningful if the buffer is intact */
+	rows = rend->rows;
+	if (!rend->hashing || !rend->age ||
+	    rows * ctx->cell_height > rend->height)
+		return;
+
+	rend->saw_reset = false;
+	ctx_draw(ctx, wlt_renderer_hash_cell, rend);
+
+	/* the draw pass must not add to the hashes a second time */
+	rend->hashing = false;
+
+	base_n = count_matches(rend, 0);
+	best_n = base_n;
+	best_d = 0;
+
+	for (d = 1 - (int)rows; d < (int)rows; ++d) {
+		if (!d)
+			continue;
+
+		/* can't beat the current best with this offset */
+		if (rows - abs(d) <= best_n)
+			continue;
+
+		n = count_matches(rend, d);
+		if (n > best_n) {
+			best_n = n;
+			best_d = d;
+		}
+	}
+
+	/* Moving the buffer costs a full memmove, so only do it if it saves a
+	 * significant number of rows. */
+	if (best_d && best_n - base_n >= rows / 4 + 1) {
+		wlt_renderer_scroll(rend, ctx->cell_height, best_d);
+
+		for (i = 0; i < rows; ++i) {
+			d = (int)i + best_d;
+			rend->row_keep[i] = d >= 0 && d < (int)rows &&
+				rend->new_hash[i] == rend->row_hash[d] &&
+				!rend->row_redraw[d];
+		}
+
+		rend->scrolled = true;
+	}
+
+	/* The hash-pass consumed a pending age-reset of the screen, so the
+	 * draw-pass below won't see it. Redraw everything instead. */
+	if (rend->saw_reset)
+		rend->age = 0;
+
 }
 
 static bool overlap(const struct wlt_draw_ctx *ctx, double x1, double y1,
@@ -308,31 +1438,49 @@ static int wlt_renderer_draw_cell(struct tsm_screen *screen, uint32_t id,
 	uint8_t fr, fg, fb, br, bg, bb;
 	unsigned int x, y;
 	int fattrs;
-	uint32_t c = *ch;
+	unsigned long key;
+	struct wlt_face *face;
 	struct wlt_glyph *glyph;
-	bool skip, inverse;
+	struct wlt_color_glyph *colored;
+	struct wlt_op op;
+	bool skip, inverse, pending;
 	int r;
 
 	x = posx * ctx->cell_width;
 	y = posy * ctx->cell_height;
 
+	if (rend->hashing)
+		row_hash_cell(rend, id, len, cwidth, posx, posy, attr);
+
 	/* If the cell is inside of the dirty-region *and* our age and the
 	 * cell age is non-zero *and* the cell-age is smaller than our age,
-	 * then skip drawing as it's already on-screen. */
-	skip = overlap(ctx, x, y, x + ctx->cell_width, y + ctx->cell_height);
-	skip = skip && age && rend->age && age <= rend->age;
+	 * then skip drawing as it's already on-screen. After a scroll, ages
+	 * are meaningless; only rows that were moved into place are kept. */
+	if (rend->scrolled) {
+		skip = posy < rend->rows && rend->row_keep[posy];
+	} else {
+		skip = overlap(ctx, x, y, x + ctx->cell_width,
+			       y + ctx->cell_height);
+		skip = skip && age && rend->age && age <= rend->age;
+		skip = skip && !(posy < rend->rows && rend->row_redraw[posy]);
+	}
 
-	if (skip && !wlt_config_get_show_dirty(ctx->config))
+	++rend->stats.cells;
+	if (skip && !wlt_config_get_show_dirty(ctx->config)) {
+		++rend->stats.skipped;
 		return 0;
+	}
+	++rend->stats.drawn;
 
 	fattrs = WLT_FACE_PLAIN;
 	if (attr->bold)
 		fattrs |= WLT_FACE_BOLD;
-	if (attr->underline)
-		fattrs |= WLT_FACE_UNDERLINE;
 	if (attr->italic)
 		fattrs |= WLT_FACE_ITALICS;
 
+	op.underline = attr->underline &&
+		       wlt_config_get_underline(ctx->config);
+
 	inverse = attr->inverse;
 	if (attr->selection)
 		inverse = !inverse;
@@ -361,12 +1509,7 @@ static int wlt_renderer_draw_cell(struct tsm_screen *screen, uint32_t id,
 			extract_rgb(wlt_config_get_cursor_bg(ctx->config), &br, &bg, &bb);
 			break;
 		case WLT_CURSOR_UNDERLINE:
-			fattrs ^= WLT_FACE_UNDERLINE;
-			if (!len)
-			{
-				len = 1;
-				c = ' ';
-			}
+			op.underline = !op.underline;
 			break;
 		case WLT_CURSOR_INVERSE:
 		default:
@@ -383,54 +1526,115 @@ static int wlt_renderer_draw_cell(struct tsm_screen *screen, uint32_t id,
 		t = fb; fb = bb; bb = t;
 	} 
 
-	/* !len means background-only */
-	if (!len) {
-		wlt_renderer_fill(rend, x, y, ctx->cell_width * cwidth,
-				  ctx->cell_height, br, bg, bb);
-	} else {
-		r = wlt_face_render(ctx->faces[fattrs], &glyph, id, &c, len, cwidth);
-		if (r < 0)
-			wlt_renderer_fill(rend, x, y, ctx->cell_width * cwidth,
-					  ctx->cell_height, br, bg, bb);
-		else
-			wlt_renderer_blend(rend, glyph, x, y,
-					   fr, fg, fb, br, bg, bb);
+	op.x = x;
+	op.y = y;
+	op.width = ctx->cell_width * cwidth;
+	op.height = ctx->cell_height;
+	op.glyph = NULL;
+	op.colored = NULL;
+	op.fc = (fr << 16) | (fg << 8) | fb;
+	op.bc = (br << 16) | (bg << 8) | bb;
+	op.highlight = !skip && wlt_config_get_show_dirty(ctx->config);
+
+	/* !len means background-only. Prefer an already blended copy of the
+	 * glyph; if there is none yet, blend it once into a new entry. Entries
+	 * added earlier in this frame may not be filled yet in parallel mode,
+	 * so those cells are blended directly. The tsm id is only valid for
+	 * this screen, while faces are shared, so glyphs are looked up by key. */
+	face = ctx->faces[fattrs];
+	if (len && wlt_face_get_key(face, &key, ch, len) >= 0) {
+		r = wlt_face_lookup_color(face, &colored, key, op.fc, op.bc);
+		if (r >= 0) {
+			op.colored = colored;
+		} else {
+			pending = r == -EBUSY;
+			r = wlt_face_render(face, &glyph, key, ch, len, cwidth,
+					    ctx->cell_width, ctx->cell_height);
+			if (r == -EAGAIN && posy < rend->rows)
+				rend->row_pending[posy] = true;
+			if (r >= 0) {
+				op.glyph = glyph;
+				if (!pending)
+					r = wlt_face_add_color(face, &colored,
+							       glyph, op.fc,
+							       op.bc,
+							       ctx->cell_height);
+				if (!pending && r >= 0)
+					op.colored = colored;
+			}
+		}
 	}
 
-	if (!skip && wlt_config_get_show_dirty(ctx->config))
-		wlt_renderer_highlight(rend, x, y, ctx->cell_width * cwidth,
-				       ctx->cell_height);
+	if (!rend->pool || wlt_renderer_push_op(rend, &op) < 0)
+		wlt_renderer_exec_op(rend, &op);
+
+	wlt_renderer_damage(rend, x, y, ctx->cell_width * cwidth,
+			    ctx->cell_height);
 
 	return 0;
 }
 
-void wlt_renderer_draw(const struct wlt_draw_ctx *ctx)
+void wlt_renderer_update(const struct wlt_draw_ctx *ctx)
 {
 	struct wlt_renderer *rend = ctx->rend;
-	struct tsm_screen_attr attr;
-	unsigned int w, h;
+	const struct wlt_rect *r;
+	size_t i;
+	bool rows;
 
 	/* cairo is *way* too slow to render all masks efficiently. Therefore,
 	 * we render all glyphs into a shadow buffer on the CPU and then tell
 	 * cairo to blit it into the gtk buffer. This way we get two mem-writes
-	 * but at least it's fast enough to render a whole screen. */
+	 * but at least it's fast enough to render a whole screen. Only the
+	 * cells we actually touched are reported as damage, so the caller can
+	 * restrict the blit to those. */
+
+	rend->n_damage = 0;
+	rend->damage_collapsed = false;
+	++rend->stats.frames;
+
+	if (ctx->font)
+		wlt_font_next_frame(ctx->font);
+	if (ctx->faces[0])
+		wlt_face_get_metrics(ctx->faces[0], &rend->metrics);
 
 	cairo_surface_flush(rend->surface);
-	rend->age = tsm_screen_draw(ctx->screen, wlt_renderer_draw_cell,
-				    (void*)ctx);
-	cairo_surface_mark_dirty(rend->surface);
+	rows = wlt_renderer_begin_rows(rend, ctx) >= 0;
+	if (rows && ctx_may_scroll(ctx))
+		wlt_renderer_detect_scroll(rend, ctx);
+	rend->age = ctx_draw(ctx, wlt_renderer_draw_cell, (void*)ctx);
+	if (rows)
+		wlt_renderer_end_rows(rend);
+	if (rend->pool)
+		wlt_renderer_run_ops(rend);
+	wlt_renderer_merge_damage(rend);
 
+	for (i = 0; i < rend->n_damage; ++i) {
+		r = &rend->damage[i];
+		cairo_surface_mark_dirty_rectangle(rend->surface, r->x, r->y,
+						   r->width, r->height);
+	}
+}
+
+void wlt_renderer_draw(const struct wlt_draw_ctx *ctx)
+{
+	struct wlt_renderer *rend = ctx->rend;
+	unsigned int w, h;
+
+	/* The clip of @ctx->cr is set up by the caller, so this only blits
+	 * the invalidated regions. */
 	cairo_set_source_surface(ctx->cr, rend->surface, 0, 0);
 	cairo_paint(ctx->cr);
 
-	/* draw padding */
-	w = tsm_screen_get_width(ctx->screen);
-	h = tsm_screen_get_height(ctx->screen);
-	tsm_vte_get_def_attr(ctx->vte, &attr);
+	/* draw padding, if it is part of the clip */
+	w = ctx_columns(ctx) * ctx->cell_width;
+	h = ctx_rows(ctx) * ctx->cell_height;
+	if (ctx->x2 <= w && ctx->y2 <= h)
+		return;
+
 	cairo_set_source_rgb(ctx->cr, 0, 0, 0);
-	cairo_move_to(ctx->cr, w * ctx->cell_width, 0);
-	cairo_line_to(ctx->cr, w * ctx->cell_width, h * ctx->cell_height);
-	cairo_line_to(ctx->cr, 0, h * ctx->cell_height);
+	cairo_move_to(ctx->cr, w, 0);
+	cairo_line_to(ctx->cr, w, h);
+	cairo_line_to(ctx->cr, 0, h);
 	cairo_line_to(ctx->cr, 0, rend->height);
 	cairo_line_to(ctx->cr, rend->width, rend->height);
 	cairo_line_to(ctx->cr, rend->width, 0);
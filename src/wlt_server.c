@@ -0,0 +1,381 @@
+/*
+ * wlterm - window server
+ *
+ * Copyright (c) 2017 Pamelloes <pamelloes@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Window Server
+ * A wlterm started with --server keeps running without a window of its own and
+ * opens one whenever a client asks for it. All windows share the process, so
+ * fonts, faces and glyph caches are loaded once, and a client never has to
+ * initialize GTK.
+ *
+ * Clients talk to the server over a Unix socket in the user's runtime
+ * directory. A request is a list of NUL-terminated strings: the working
+ * directory, the environment of the client terminated by an empty string, and
+ * the command to run, if any. Shells thus see the DISPLAY, PATH, agent
+ * sockets and so on of the client, not the stale ones the server was started
+ * with. The client then shuts down its sending side. The server answers with
+ * a single int, 0 or a negative error code, and closes the connection.
+ * Connections from other users are rejected.
+ */
+
+#include <cairo.h>
+#include <errno.h>
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "wlterm.h"
+
+/* environments can be large; execve() allows them up to a few MiB, too */
+#define WLT_SERVER_MAX_REQUEST (1024 * 1024)
+
+struct wlt_server {
+	int fd;
+	char *path;
+	GIOChannel *chan;
+	guint src;
+	GList *conns;
+
+	wlt_server_cb cb;
+	void *data;
+};
+
+struct wlt_conn {
+	struct wlt_server *server;
+	int fd;
+	GIOChannel *chan;
+	guint src;
+	GByteArray *buf;
+};
+
+/* the socket path; free it with g_free() */
+char *wlt_server_get_path(void)
+{
+	return g_build_filename(g_get_user_runtime_dir(), "wlterm.sock", NULL);
+}
+
+static int make_addr(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path))
+		return -ENAMETOOLONG;
+
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+static void conn_free(struct wlt_conn *conn)
+{
+	conn->server->conns = g_list_remove(conn->server->conns, conn);
+	if (conn->src)
+		g_source_remove(conn->src);
+	g_io_channel_unref(conn->chan);
+	close(conn->fd);
+	g_byte_array_unref(conn->buf);
+	free(conn);
+}
+
+static int conn_handle(struct wlt_conn *conn)
+{
+	struct wlt_server *server = conn->server;
+	char *data = (char*)conn->buf->data;
+	size_t len = conn->buf->len, i, n, env_end;
+	char **strv, **argv = NULL;
+	int r;
+
+	/* every string, the last one included, is NUL-terminated */
+	if (!len || data[len - 1])
+		return -EINVAL;
+
+	for (n = 0, i = 0; i < len; ++i)
+		if (!data[i])
+			++n;
+
+	strv = calloc(n + 1, sizeof(*strv));
+	if (!strv)
+		return -ENOMEM;
+
+	for (n = 0, i = 0; i < len; i += strlen(&data[i]) + 1)
+		strv[n++] = &data[i];
+
+	/* the environment follows the cwd and ends with an empty string */
+	for (env_end = 1; env_end < n && *strv[env_end]; ++env_end)
+		;
+	if (env_end >= n) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	strv[env_end] = NULL;
+	if (env_end + 1 < n)
+		argv = &strv[env_end + 1];
+
+	r = server->cb(server, *strv[0] ? strv[0] : NULL, &strv[1], argv,
+		       server->data);
+
+out:
+	free(strv);
+	return r;
+}
+
+static gboolean conn_cb(GIOChannel *chan, GIOCondition cond, gpointer data)
+{
+	struct wlt_conn *conn = data;
+	char buf[4096];
+	ssize_t len;
+	int32_t reply;
+
+	len = read(conn->fd, buf, sizeof(buf));
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return TRUE;
+
+	if (len > 0) {
+		if (conn->buf->len + len <= WLT_SERVER_MAX_REQUEST) {
+			g_byte_array_append(conn->buf, (guint8*)buf, len);
+			return TRUE;
+		}
+		reply = -EMSGSIZE;
+	} else if (!len) {
+		reply = conn_handle(conn);
+	} else {
+		reply = -errno;
+	}
+
+	if (send(conn->fd, &reply, sizeof(reply), MSG_NOSIGNAL) < 0) {
+		/* the client went away; nobody to tell */
+	}
+
+	conn->src = 0;
+	conn_free(conn);
+	return FALSE;
+}
+
+static gboolean server_accept_cb(GIOChannel *chan, GIOCondition cond,
+				 gpointer data)
+{
+	struct wlt_server *server = data;
+	struct wlt_conn *conn;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	int fd;
+
+	fd = accept4(server->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0)
+		return TRUE;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+	    cred.uid != getuid()) {
+		close(fd);
+		return TRUE;
+	}
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn) {
+		close(fd);
+		return TRUE;
+	}
+
+	conn->server = server;
+	conn->fd = fd;
+	conn->buf = g_byte_array_new();
+	conn->chan = g_io_channel_unix_new(fd);
+	conn->src = g_io_add_watch(conn->chan, G_IO_IN | G_IO_HUP | G_IO_ERR,
+				   conn_cb, conn);
+	server->conns = g_list_prepend(server->conns, conn);
+
+	return TRUE;
+}
+
+/*
+ * Listen on the socket at @path and call @cb for every request. Fails with
+ * -EADDRINUSE if another server is already listening there; a socket left
+ * behind by a dead one is replaced.
+ */
+int wlt_server_new(struct wlt_server **out, const char *path, wlt_server_cb cb,
+		   void *data)
+{
+	struct wlt_server *server;
+	struct sockaddr_un addr;
+	int r, fd;
+
+	r = make_addr(&addr, path);
+	if (r < 0)
+		return r;
+
+	server = calloc(1, sizeof(*server));
+	if (!server)
+		return -ENOMEM;
+	server->fd = -1;
+	server->cb = cb;
+	server->data = data;
+
+	server->path = strdup(path);
+	if (!server->path) {
+		r = -ENOMEM;
+		goto error;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		r = -errno;
+		goto error;
+	}
+
+	if (!connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+		close(fd);
+		r = -EADDRINUSE;
+		goto error;
+	}
+	close(fd);
+	unlink(path);
+
+	server->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC |
+			    SOCK_NONBLOCK, 0);
+	if (server->fd < 0) {
+		r = -errno;
+		goto error;
+	}
+
+	if (bind(server->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+	    chmod(path, S_IRUSR | S_IWUSR) < 0 ||
+	    listen(server->fd, 16) < 0) {
+		r = -errno;
+		goto error;
+	}
+
+	server->chan = g_io_channel_unix_new(server->fd);
+	server->src = g_io_add_watch(server->chan, G_IO_IN, server_accept_cb,
+				     server);
+
+	*out = server;
+	return 0;
+
+error:
+	wlt_server_free(server);
+	return r;
+}
+
+void wlt_server_free(struct wlt_server *server)
+{
+	if (!server)
+		return;
+
+	while (server->conns)
+		conn_free(server->conns->data);
+
+	if (server->src)
+		g_source_remove(server->src);
+	if (server->chan)
+		g_io_channel_unref(server->chan);
+	if (server->fd >= 0) {
+		close(server->fd);
+		unlink(server->path);
+	}
+	free(server->path);
+	free(server);
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+	ssize_t l;
+
+	while (len) {
+		l = send(fd, buf, len, MSG_NOSIGNAL);
+		if (l < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		buf += l;
+		len -= l;
+	}
+
+	return 0;
+}
+
+/*
+ * Ask the server at @path to open a window running @argv, or the default
+ * command if it is NULL, in @cwd and with the environment @envp. Returns the
+ * server's answer; -ENOENT or -ECONNREFUSED mean no server is running.
+ */
+int wlt_client_open(const char *path, const char *cwd, char *const *envp,
+		    char *const *argv)
+{
+	struct sockaddr_un addr;
+	int32_t reply;
+	ssize_t len;
+	int r, fd, i;
+
+	r = make_addr(&addr, path);
+	if (r < 0)
+		return r;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		r = -errno;
+		goto out;
+	}
+
+	if (!cwd)
+		cwd = "";
+	r = send_all(fd, cwd, strlen(cwd) + 1);
+	for (i = 0; !r && envp && envp[i]; ++i)
+		if (*envp[i])
+			r = send_all(fd, envp[i], strlen(envp[i]) + 1);
+	if (!r)
+		r = send_all(fd, "", 1);
+	for (i = 0; !r && argv && argv[i]; ++i)
+		r = send_all(fd, argv[i], strlen(argv[i]) + 1);
+	if (r < 0)
+		goto out;
+
+	shutdown(fd, SHUT_WR);
+
+	do {
+		len = read(fd, &reply, sizeof(reply));
+	} while (len < 0 && errno == EINTR);
+
+	if (len < 0)
+		r = -errno;
+	else if (len != sizeof(reply))
+		r = -EPIPE;
+	else
+		r = reply;
+
+out:
+	close(fd);
+	return r;
+}
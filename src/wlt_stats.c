@@ -0,0 +1,282 @@
+/*
+ * wlterm - statistics
+ *
+ * Copyright (c) 2017 Pamelloes <pamelloes@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Statistics
+ * Always-on counters that are cheap enough to keep in production builds.
+ * Frame times go into log-linear histograms: values below 16us get a bucket
+ * each, above that every power of two is split into 8 buckets, so any
+ * percentile is off by at most 12.5%. Adding a sample is a bit-scan and an
+ * increment. Cell and glyph counters live in the renderer and the faces and
+ * are only collected when a summary is dumped.
+ */
+
+#include <cairo.h>
+#include <errno.h>
+#include <glib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "wlterm.h"
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_LINEAR (2 * HIST_SUB)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* pty throughput is sampled over windows of this length; a window starts
+ * with the first byte after the previous one closed, so idle time between
+ * bursts is never averaged in */
+#define RATE_WINDOW 1000000
+
+struct wlt_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+struct wlt_stats {
+	int64_t start;
+	struct wlt_histogram timers[WLT_STATS_TIMER_NUM];
+
+	uint64_t input;
+	uint64_t window_input;
+	int64_t window_start;
+	int64_t last_end;
+	uint64_t last_rate;
+	uint64_t peak_rate;
+};
+
+static const char *timer_names[] = {
+	[WLT_STATS_UPDATE] = "update",
+	[WLT_STATS_DRAW] = "draw",
+};
+
+static unsigned int hist_index(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < HIST_LINEAR)
+		return v;
+
+	e = 63 - __builtin_clzll(v);
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+	       ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* smallest value that falls into bucket @i */
+static uint64_t hist_value(unsigned int i)
+{
+	unsigned int e;
+
+	if (i < HIST_LINEAR)
+		return i;
+
+	e = i / HIST_SUB + HIST_SUB_BITS - 1;
+	return (uint64_t)(HIST_SUB + i % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+static void hist_add(struct wlt_histogram *h, uint64_t v)
+{
+	++h->count;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+	++h->buckets[hist_index(v)];
+}
+
+/* upper bound of the bucket containing the @p'th percentile */
+static uint64_t hist_percentile(const struct wlt_histogram *h, unsigned int p)
+{
+	uint64_t target, seen = 0;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+
+	target = (h->count * p + 99) / 100;
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		seen += h->buckets[i];
+		if (seen >= target)
+			break;
+	}
+
+	if (i + 1 >= HIST_BUCKETS || hist_value(i + 1) - 1 > h->max)
+		return h->max;
+
+	return hist_value(i + 1) - 1;
+}
+
+int wlt_stats_new(struct wlt_stats **out)
+{
+	struct wlt_stats *stats;
+
+	stats = calloc(1, sizeof(*stats));
+	if (!stats)
+		return -ENOMEM;
+
+	stats->start = g_get_monotonic_time();
+
+	*out = stats;
+	return 0;
+}
+
+void wlt_stats_free(struct wlt_stats *stats)
+{
+	free(stats);
+}
+
+void wlt_stats_add_time(struct wlt_stats *stats, enum wlt_stats_timer timer,
+			int64_t usec)
+{
+	hist_add(&stats->timers[timer], usec > 0 ? usec : 0);
+}
+
+/* all input of an open window arrived within RATE_WINDOW of its start */
+static void close_window(struct wlt_stats *stats, int64_t now)
+{
+	if (!stats->window_input || now - stats->window_start < RATE_WINDOW)
+		return;
+
+	stats->last_rate = stats->window_input * 1000000 / RATE_WINDOW;
+	if (stats->last_rate > stats->peak_rate)
+		stats->peak_rate = stats->last_rate;
+	stats->last_end = stats->window_start + RATE_WINDOW;
+	stats->window_input = 0;
+}
+
+void wlt_stats_add_input(struct wlt_stats *stats, size_t bytes)
+{
+	int64_t now;
+
+	now = g_get_monotonic_time();
+	close_window(stats, now);
+	if (!stats->window_input)
+		stats->window_start = now;
+
+	stats->input += bytes;
+	stats->window_input += bytes;
+}
+
+static void dump_timer(struct wlt_stats *stats, FILE *out,
+		       enum wlt_stats_timer timer)
+{
+	const struct wlt_histogram *h = &stats->timers[timer];
+
+	fprintf(out, "  %-6s %8llu frames, avg %lluus, p50 %lluus, "
+		"p95 %lluus, p99 %lluus, max %lluus\n",
+		timer_names[timer],
+		(unsigned long long)h->count,
+		(unsigned long long)(h->count ? h->sum / h->count : 0),
+		(unsigned long long)hist_percentile(h, 50),
+		(unsigned long long)hist_percentile(h, 95),
+		(unsigned long long)hist_percentile(h, 99),
+		(unsigned long long)h->max);
+}
+
+static void dump_cache(FILE *out, const char *name,
+		       const struct wlt_cache_stats *c)
+{
+	fprintf(out, "  %-6s %8lu hits, %lu misses, %lu failures, "
+		"%lu evictions, %zu/%zu KiB\n",
+		name, c->hits, c->misses, c->failures, c->evictions,
+		c->size / 1024, c->max_size / 1024);
+}
+
+static double percent(unsigned long part, unsigned long total)
+{
+	return total ? part * 100.0 / total : 0.0;
+}
+
+/* print a summary of everything collected so far; @ctx may be NULL or
+ * partially filled, then only the counters we have are printed */
+void wlt_stats_dump(struct wlt_stats *stats, FILE *out,
+		    const struct wlt_draw_ctx *ctx)
+{
+	static const char *face_names[] = {
+		"plain", "b", "i", "bi",
+	};
+	struct wlt_render_stats rs;
+	struct wlt_cache_stats cs;
+	char name[16];
+	int64_t now, elapsed;
+	uint64_t last;
+	unsigned int i, j;
+
+	now = g_get_monotonic_time();
+	elapsed = now - stats->start;
+
+	/* the last window only counts if the pty didn't go quiet since */
+	close_window(stats, now);
+	last = now - stats->last_end < RATE_WINDOW ? stats->last_rate : 0;
+
+	fprintf(out, "wlterm stats after %.1fs\n", elapsed / 1000000.0);
+	for (i = 0; i < WLT_STATS_TIMER_NUM; ++i)
+		dump_timer(stats, out, i);
+
+	if (ctx && ctx->rend) {
+		wlt_renderer_get_stats(ctx->rend, &rs);
+		fprintf(out, "  cells  %8lu visited, %lu drawn (%.1f%%), "
+			"%lu skipped (%.1f%%)\n",
+			rs.cells, rs.drawn, percent(rs.drawn, rs.cells),
+			rs.skipped, percent(rs.skipped, rs.cells));
+	}
+
+	if (ctx && ctx->font) {
+		wlt_font_get_glyph_stats(ctx->font, &cs);
+		dump_cache(out, "glyph", &cs);
+		wlt_font_get_color_stats(ctx->font, &cs);
+		dump_cache(out, "color", &cs);
+	}
+
+	for (i = 0; ctx && i < 4; ++i) {
+		if (!ctx->faces[i])
+			continue;
+
+		/* attribute combinations that aren't enabled share a face */
+		for (j = 0; j < i; ++j)
+			if (ctx->faces[j] == ctx->faces[i])
+				break;
+		if (j < i)
+			continue;
+
+		wlt_face_get_stats(ctx->faces[i], &cs);
+		snprintf(name, sizeof(name), "[%s]", face_names[i]);
+		fprintf(out, "  %-6s %8lu hits, %lu misses (%.1f%% hit), "
+			"%lu failures\n", name, cs.hits, cs.misses,
+			percent(cs.hits, cs.hits + cs.misses), cs.failures);
+	}
+
+	fprintf(out, "  input  %8llu bytes, avg %llu B/s, last %llu B/s, "
+		"peak %llu B/s\n",
+		(unsigned long long)stats->input,
+		(unsigned long long)(elapsed > 0 ?
+				     stats->input * 1000000 / elapsed : 0),
+		(unsigned long long)last,
+		(unsigned long long)stats->peak_rate);
+
+	fflush(out);
+}
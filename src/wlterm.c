@@ -27,13 +27,20 @@
  * wlterm - Wayland Terminal
  * This is a rewrite of wlterm using GTK. It's meant to be simple and small and
  * serve as example how to use GTK+tsm+pango to write terminal emulators.
+ *
+ * A host holds everything that windows can share: the font with its glyph
+ * caches, the faces and the pty bridge. Normally it has a single terminal and
+ * the process exits with it. With --server, it has none to begin with and
+ * opens one for every --client request (see wlt_server.c).
  */
 
 #include <cairo.h>
 #include <errno.h>
+#include <glib-unix.h>
 #include <gtk/gtk.h>
 #include <libtsm.h>
 #include <math.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -43,8 +50,33 @@
 #include "shl_pty.h"
 #include "wlterm.h"
 
+#define WLT_READER_SIZE (1 << 20)
+#define WLT_PTY_RING_SIZE (1 << 20)
+
+/* the child starts before we know the window size; see spawn_shell() */
+#define WLT_EARLY_COLUMNS 80
+#define WLT_EARLY_ROWS 24
+
+struct host {
+	struct wlt_config *config;
+	struct wlt_font *font;
+	struct wlt_face *faces[4];
+	unsigned int face_scale;
+	struct wlt_pool *render_pool;
+	int pty_bridge;
+	GIOChannel *bridge_chan;
+	guint bridge_src;
+	struct wlt_server *server;
+	guint int_src;
+	guint term_src;
+	guint stats_src;
+	GList *terms;
+};
+
 struct term {
+	struct host *host;
 	struct wlt_config *config;
+	guint close_src;
 
 	GtkWidget *window;
 	GdkKeymap *keymap;
@@ -57,12 +89,22 @@ struct term {
 	int pty_bridge;
 	GIOChannel *bridge_chan;
 	guint bridge_src;
+	struct wlt_reader *reader;
+	GIOChannel *reader_chan;
+	guint reader_src;
+	struct wlt_parser *parser;
+	GIOChannel *parser_chan;
+	guint parser_src;
+	struct wlt_snapshot *snap;
 	GSource *pty_idle;
 	guint pty_idle_src;
 	guint child_src;
+	guint tick_id;
+	gint64 last_frame;
+	struct wlt_stats *stats;
 
 	struct wlt_renderer *rend;
-	struct wlt_face *faces[8];
+	struct wlt_face *faces[4];
 	unsigned int scale;
 	double iscale;
 	unsigned int cell_width;
@@ -78,8 +120,12 @@ struct term {
 	gdouble sel_y;
 
 	unsigned int adjust_size : 1;
+	unsigned int own_bridge : 1;
 	unsigned int initialized : 1;
+	unsigned int dirty : 1;
 	unsigned int exited : 1;
+	unsigned int may_scroll : 1;
+	unsigned int in_sb : 1;
 };
 
 static void err(const char *format, ...)
@@ -136,15 +182,31 @@ static void log_tsm(void *data, const char *file, int line, const char *fn,
 	fprintf(stderr, "\n");
 }
 
-static void __attribute__((noreturn)) term_run_child(struct term *term)
+/* with a parser thread, the screen and vte may only be used while locked */
+static void term_lock(struct term *term)
 {
-	char *const *argv = wlt_config_get_argv(term->config);
+	if (term->parser)
+		wlt_parser_lock(term->parser);
+}
 
-	setenv("TERM", "xterm-256color", 1);
-	execve(argv[0], argv, environ);
-	exit(1);
+static void term_unlock(struct term *term)
+{
+	if (term->parser)
+		wlt_parser_unlock(term->parser);
 }
 
+/* the scrollback view moved; must be called with the screen locked */
+static void term_scrolled(struct term *term)
+{
+	if (term->parser)
+		wlt_parser_scrolled(term->parser);
+	else
+		term->may_scroll = 1;
+}
+
+static void term_free(struct term *term);
+static void term_hide(struct term *term);
+
 static void term_set_geometry(struct term *term)
 {
 	GdkWindowHints hints;
@@ -177,48 +239,73 @@ static void term_recalc_cells(struct term *term)
 		term->rows = 1;
 }
 
-static int term_change_font(struct term *term)
+/*
+ * Faces only depend on the config and the scale, so all windows share them.
+ * Only the plain face, which defines the cell size, is loaded right away; the
+ * others are loaded the first time a cell uses them.
+ */
+static int host_load_faces(struct host *host, unsigned int scale)
 {
-	int r, i;
-	struct wlt_face *new[8];
+	struct wlt_face *new[4];
+	const char *name;
+	int r, i, index, size;
 
-	i = 0;
-	for (int i = 0; i < 8; ++i)
-	{
-		int index = i;
-		if (!wlt_config_get_bold(term->config))
+	name = wlt_config_get_font_name(host->config);
+	size = scale * wlt_config_get_font_size(host->config);
+
+	for (i = 0; i < 4; ++i) {
+		index = i;
+		if (!wlt_config_get_bold(host->config))
 			index &= ~WLT_FACE_BOLD;
-		if (!wlt_config_get_underline(term->config))
-			index &= ~WLT_FACE_UNDERLINE;
-		if (!wlt_config_get_italics(term->config))
+		if (!wlt_config_get_italics(host->config))
 			index &= ~WLT_FACE_ITALICS;
 
-		if (index != i)
-		{
+		if (index != i) {
 			new[i] = new[index];
 			wlt_face_ref(new[i]);
 			continue;
 		}
 
-		r = wlt_face_new(&new[i], term->font, 
-		                 wlt_config_get_font_name(term->config),
-		                 term->scale * wlt_config_get_font_size(term->config),
-		                 index);
+		if (!i)
+			r = wlt_face_new(&new[i], host->font, name, size, i);
+		else
+			r = wlt_face_new_lazy(&new[i], host->font, name, size,
+					      i);
 		if (r < 0)
 			break;
 	}
 
-	if (r < 0)
-	{
+	if (r < 0) {
 		for (--i; i >= 0; --i)
 			wlt_face_unref(new[i]);
 		return r;
 	}
 
-	for (i = 0; i < 8; ++i)
+	for (i = 0; i < 4; ++i) {
+		wlt_face_unref(host->faces[i]);
+		host->faces[i] = new[i];
+	}
+	host->face_scale = scale;
+
+	return 0;
+}
+
+static int term_change_font(struct term *term)
+{
+	struct host *host = term->host;
+	int r, i;
+
+	if (!host->faces[0] || host->face_scale != term->scale) {
+		r = host_load_faces(host, term->scale);
+		if (r < 0)
+			return r;
+	}
+
+	for (i = 0; i < 4; ++i)
 	{
+		wlt_face_ref(host->faces[i]);
 		wlt_face_unref(term->faces[i]);
-		term->faces[i] = new[i];
+		term->faces[i] = host->faces[i];
 	}
 
 	term->cell_width = wlt_face_get_width(term->faces[0]);
@@ -231,7 +318,9 @@ static void term_notify_resize(struct term *term)
 {
 	int r;
 
+	term_lock(term);
 	r = tsm_screen_resize(term->screen, term->columns, term->rows);
+	term_unlock(term);
 	if (r < 0)
 		err("cannot resize TSM screen (%d)", r);
 
@@ -240,12 +329,303 @@ static void term_notify_resize(struct term *term)
 		err("cannot resize pty (%d)", r);
 }
 
-static void term_read_cb(struct shl_pty *pty, char *u8, size_t len, void *data)
+static void term_fill_ctx(struct term *term, struct wlt_draw_ctx *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->config = term->config;
+	ctx->rend = term->rend;
+	ctx->font = term->font;
+	memcpy(ctx->faces, term->faces, sizeof(term->faces));
+	ctx->cell_width = term->cell_width;
+	ctx->cell_height = term->cell_height;
+	ctx->screen = term->screen;
+	ctx->vte = term->vte;
+	ctx->snap = term->snap;
+}
+
+/*
+ * Render all changed cells into the shadow buffer and invalidate only the
+ * regions that were touched. GTK then restricts the next redraw to these.
+ */
+static void term_update(struct term *term)
+{
+	struct wlt_draw_ctx ctx;
+	const struct wlt_rect *rects;
+	size_t i, n;
+	int x1, y1, x2, y2;
+	int64_t start;
+
+	if (!term->initialized)
+		return;
+
+	if (term->parser)
+		term->snap = wlt_parser_acquire(term->parser);
+
+	term_fill_ctx(term, &ctx);
+	ctx.x2 = term->width * term->scale;
+	ctx.y2 = term->height * term->scale;
+	ctx.may_scroll = term->may_scroll;
+	term->may_scroll = 0;
+
+	start = g_get_monotonic_time();
+	wlt_renderer_update(&ctx);
+	wlt_stats_add_time(term->stats, WLT_STATS_UPDATE,
+			   g_get_monotonic_time() - start);
+
+	n = wlt_renderer_get_damage(term->rend, &rects);
+	for (i = 0; i < n; ++i) {
+		x1 = rects[i].x / term->scale;
+		y1 = rects[i].y / term->scale;
+		x2 = (rects[i].x + rects[i].width + term->scale - 1) /
+		     term->scale;
+		y2 = (rects[i].y + rects[i].height + term->scale - 1) /
+		     term->scale;
+		gtk_widget_queue_draw_area(term->tarea, x1, y1, x2 - x1,
+					   y2 - y1);
+	}
+}
+
+/*
+ * Updates are paced by the frame clock of the widget. Any number of state
+ * changes between two frames (pty output, selection, scrolling) only mark the
+ * terminal dirty; the next frame renders the latest screen state once. Under
+ * output floods this gives jump-scrolling: the pty is drained at full speed
+ * and intermediate screen states are simply never drawn. Optionally, frames
+ * are further limited to max_fps.
+ */
+static gboolean term_tick_cb(GtkWidget *widget, GdkFrameClock *clock,
+			     gpointer data)
 {
 	struct term *term = data;
+	gint64 now;
+	int fps;
+
+	if (!term->dirty) {
+		term->tick_id = 0;
+		return G_SOURCE_REMOVE;
+	}
+
+	now = gdk_frame_clock_get_frame_time(clock);
+	fps = wlt_config_get_max_fps(term->config);
+	if (fps > 0 && now - term->last_frame < 1000000 / fps)
+		return G_SOURCE_CONTINUE;
+
+	term->dirty = 0;
+	term->last_frame = now;
+	term_update(term);
+
+	return G_SOURCE_CONTINUE;
+}
 
+static void term_flush_update(struct term *term)
+{
+	if (!term->dirty)
+		return;
+
+	term->dirty = 0;
+	term_update(term);
+}
+
+/* Schedule a shadow-buffer update for the next frame. */
+static void term_schedule_update(struct term *term)
+{
+	term->dirty = 1;
+	if (term->tick_id || !term->tarea)
+		return;
+
+	term->tick_id = gtk_widget_add_tick_callback(term->tarea, term_tick_cb,
+						     term, NULL);
+}
+
+static void host_glyphs_cb(struct wlt_font *font, void *data)
+{
+	struct host *host = data;
+	GList *l;
+
+	for (l = host->terms; l; l = l->next)
+		term_schedule_update(l->data);
+}
+
+static void term_input(const char *u8, size_t len, void *data)
+{
+	struct term *term = data;
+
+	wlt_stats_add_input(term->stats, len);
+	if (wlt_vte_may_scroll(u8, len))
+		term->may_scroll = 1;
 	tsm_vte_input(term->vte, u8, len);
-	gtk_widget_queue_draw(term->tarea);
+	term_schedule_update(term);
+}
+
+/*
+ * With a pty reader, this runs on the reader thread. The pty is in ring mode,
+ * so @u8 is NULL and everything read during this dispatch is taken straight
+ * from the pty's input ring.
+ */
+static void term_read_cb(struct shl_pty *pty, char *u8, size_t len, void *data)
+{
+	struct term *term = data;
+	struct iovec vec[2];
+	size_t i, n, total = 0;
+
+	if (u8) {
+		vec[0].iov_base = u8;
+		vec[0].iov_len = len;
+		n = 1;
+	} else {
+		n = shl_pty_peek(pty, vec);
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (term->reader)
+			wlt_reader_push(term->reader, vec[i].iov_base,
+					vec[i].iov_len);
+		else
+			term_input(vec[i].iov_base, vec[i].iov_len, term);
+		total += vec[i].iov_len;
+	}
+
+	if (!u8)
+		shl_pty_consume(pty, total);
+}
+
+/*
+ * Draining the pty gets a time budget per dispatch, so under floods the main
+ * loop still gets to handle input and draw frames in between. By default it
+ * is a quarter of the frame interval.
+ */
+static int64_t term_read_budget(struct term *term)
+{
+	int budget, fps;
+
+	budget = wlt_config_get_read_budget(term->config);
+	if (budget > 0)
+		return budget;
+
+	fps = wlt_config_get_max_fps(term->config);
+	if (fps <= 0)
+		fps = 60;
+
+	return 1000000 / fps / 4;
+}
+
+/* used for the host's bridge and for private ones alike */
+static gboolean term_bridge_cb(GIOChannel *chan, GIOCondition cond,
+			       gpointer data)
+{
+	int r;
+
+	r = shl_pty_bridge_dispatch(g_io_channel_unix_get_fd(chan), 0);
+	if (r < 0)
+		err("bridge dispatch failed (%d)", r);
+
+	return TRUE;
+}
+
+static gboolean term_reader_cb(GIOChannel *chan, GIOCondition cond,
+			       gpointer data)
+{
+	struct term *term = data;
+
+	wlt_reader_dispatch(term->reader, term_input, term);
+
+	return TRUE;
+}
+
+static gboolean term_parser_cb(GIOChannel *chan, GIOCondition cond,
+			       gpointer data)
+{
+	struct term *term = data;
+
+	wlt_stats_add_input(term->stats, wlt_parser_dispatch(term->parser));
+	term_schedule_update(term);
+
+	return TRUE;
+}
+
+/* Keep pty input below the redraw priority. Otherwise a flood of output
+ * keeps the input fd ready all the time and frames starve. */
+static void term_watch_input(struct term *term)
+{
+	if (term->parser) {
+		term->parser_chan = g_io_channel_unix_new(
+					wlt_parser_get_fd(term->parser));
+		term->parser_src = g_io_add_watch_full(term->parser_chan,
+						       GDK_PRIORITY_REDRAW + 10,
+						       G_IO_IN, term_parser_cb,
+						       term, NULL);
+	} else if (term->reader) {
+		term->reader_chan = g_io_channel_unix_new(
+					wlt_reader_get_fd(term->reader));
+		term->reader_src = g_io_add_watch_full(term->reader_chan,
+						       GDK_PRIORITY_REDRAW + 10,
+						       G_IO_IN, term_reader_cb,
+						       term, NULL);
+	} else if (term->own_bridge) {
+		/* the host watches its bridge itself */
+		term->bridge_chan = g_io_channel_unix_new(term->pty_bridge);
+		term->bridge_src = g_io_add_watch_full(term->bridge_chan,
+						       GDK_PRIORITY_REDRAW + 10,
+						       G_IO_IN, term_bridge_cb,
+						       term, NULL);
+	}
+}
+
+/* stop the parser thread; it owns the screen until then */
+static void term_stop_parser(struct term *term)
+{
+	if (!term->parser)
+		return;
+
+	if (term->parser_src)
+		g_source_remove(term->parser_src);
+	term->parser_src = 0;
+	g_io_channel_unref(term->parser_chan);
+	term->parser_chan = NULL;
+	wlt_parser_free(term->parser);
+	term->parser = NULL;
+	term->snap = NULL;
+}
+
+/* stop the reader thread and its consumer; it owns the pty until then */
+static void term_stop_reader(struct term *term)
+{
+	term_stop_parser(term);
+	if (!term->reader)
+		return;
+
+	if (term->reader_src)
+		g_source_remove(term->reader_src);
+	term->reader_src = 0;
+	g_io_channel_unref(term->reader_chan);
+	term->reader_chan = NULL;
+	wlt_reader_free(term->reader);
+	term->reader = NULL;
+}
+
+static gboolean term_close_cb(gpointer data)
+{
+	struct term *term = data;
+	struct host *host = term->host;
+
+	term->close_src = 0;
+	host->terms = g_list_remove(host->terms, term);
+	term->exited = 1;
+	term_hide(term);
+	term_free(term);
+
+	/* a server keeps running without windows */
+	if (!host->terms && !host->server)
+		gtk_main_quit();
+
+	return G_SOURCE_REMOVE;
+}
+
+/* close the window once we are back in the main loop */
+static void term_close(struct term *term)
+{
+	if (!term->close_src)
+		term->close_src = g_idle_add(term_close_cb, term);
 }
 
 static void term_child_cb(GPid pid, gint status, gpointer data)
@@ -254,7 +634,7 @@ static void term_child_cb(GPid pid, gint status, gpointer data)
 
 	g_spawn_close_pid(pid);
 	term->child_src = 0;
-	gtk_main_quit();
+	term_close(term);
 }
 
 static gboolean term_configure_cb(GtkWidget *widget, GdkEvent *ev,
@@ -266,7 +646,7 @@ static gboolean term_configure_cb(GtkWidget *widget, GdkEvent *ev,
 	GdkWindowState st;
 	GdkEventMask mask;
 	bool new_adjust_size = term->adjust_size;
-	int r, pid;
+	int r;
 
 	term->width = cev->width;
 	term->height = cev->height;
@@ -277,14 +657,21 @@ static gboolean term_configure_cb(GtkWidget *widget, GdkEvent *ev,
 		                     term->height * term->scale);
 		if (r < 0) {
 			err("cannot initialize renderer (%d)", r);
-			gtk_main_quit();
+			term_close(term);
 			return TRUE;
 		}
 
+		if (term->host->render_pool) {
+			r = wlt_renderer_set_pool(term->rend,
+			                          term->host->render_pool);
+			if (r < 0)
+				err("cannot render in parallel (%d)", r);
+		}
+
 		r = term_change_font(term);
 		if (r < 0) {
 			err("cannot load font (%d)", r);
-			gtk_main_quit();
+			term_close(term);
 			return TRUE;
 		}
 
@@ -294,28 +681,37 @@ static gboolean term_configure_cb(GtkWidget *widget, GdkEvent *ev,
 		term_set_geometry(term);
 		gtk_widget_queue_draw(term->tarea);
 
-		r = shl_pty_open(&term->pty, term_read_cb, term,
-				 term->columns, term->rows);
-		if (r < 0) {
-			err("cannot spawn pty (%d)", r);
-			gtk_main_quit();
-			return TRUE;
-		} else if (!r) {
-			/* child */
-			term_run_child(term);
-			exit(1);
-		}
+		/* the child is running already; its output waited in the
+		 * kernel until now */
+		shl_pty_set_callback(term->pty, term_read_cb, term);
+		shl_pty_set_ring(term->pty, WLT_PTY_RING_SIZE);
+		shl_pty_set_budget(term->pty, term_read_budget(term));
 
 		r = shl_pty_bridge_add(term->pty_bridge, term->pty);
 		if (r < 0) {
 			err("cannot add pty to bridge (%d)", r);
 			shl_pty_close(term->pty);
-			gtk_main_quit();
+			term_close(term);
 			return TRUE;
 		}
 
-		pid = shl_pty_get_child(term->pty);
-		term->child_src = g_child_watch_add(pid, term_child_cb, term);
+		if (term->reader) {
+			r = wlt_reader_start(term->reader, term->pty);
+			if (r < 0) {
+				err("cannot start pty reader (%d)", r);
+				term_stop_reader(term);
+				term_watch_input(term);
+			}
+		}
+
+		if (term->parser) {
+			r = wlt_parser_start(term->parser);
+			if (r < 0) {
+				err("cannot start parser (%d)", r);
+				term_stop_parser(term);
+				term_watch_input(term);
+			}
+		}
 
 		wnd = gtk_widget_get_window(term->window);
 		mask = gdk_window_get_events(wnd);
@@ -338,6 +734,9 @@ static gboolean term_configure_cb(GtkWidget *widget, GdkEvent *ev,
 			err("cannot resize renderer (%d)", r);
 	}
 
+	/* the shadow buffer needs a full repaint before the next redraw */
+	term_schedule_update(term);
+
 	/* adjust geometry */
 	wnd = gtk_widget_get_window(term->window);
 	st = gdk_window_get_state(wnd);
@@ -368,29 +767,62 @@ static gboolean term_redraw_cb(GtkWidget *widget, cairo_t *cr, gpointer data)
 	if (!term->initialized)
 		return FALSE;
 
+	/* make sure the shadow buffer is up-to-date before we blit it */
+	term_flush_update(term);
+
 	start = g_get_monotonic_time();
 
-	memset(&ctx, 0, sizeof(ctx));
-	ctx.config = term->config;
-	ctx.rend = term->rend;
+	term_fill_ctx(term, &ctx);
 	ctx.cr = cr;
-	memcpy(ctx.faces, term->faces, sizeof(term->faces));
-	ctx.cell_width = term->cell_width;
-	ctx.cell_height = term->cell_height;
-	ctx.screen = term->screen;
-	ctx.vte = term->vte;
 	cairo_scale(cr, term->iscale, term->iscale);
 	cairo_clip_extents(cr, &ctx.x1, &ctx.y1, &ctx.x2, &ctx.y2);
 
 	wlt_renderer_draw(&ctx);
 
 	end = g_get_monotonic_time();
-	if (0)
-		info("draw: %lldms", (end - start) / 1000);
+	wlt_stats_add_time(term->stats, WLT_STATS_DRAW, end - start);
 
 	return FALSE;
 }
 
+/*
+ * SIGUSR1 dumps the stats of all windows, oldest first, in one go. With more
+ * than one window, each dump is headed by the pid of its child.
+ */
+static gboolean host_stats_cb(gpointer data)
+{
+	struct host *host = data;
+	struct wlt_draw_ctx ctx;
+	struct term *term;
+	const char *path;
+	FILE *out = stderr;
+	GList *l;
+
+	path = wlt_config_get_stats_file(host->config);
+	if (path) {
+		out = fopen(path, "a");
+		if (!out) {
+			err("cannot open stats file %s: %m", path);
+			out = stderr;
+		}
+	}
+
+	for (l = g_list_last(host->terms); l; l = l->prev) {
+		term = l->data;
+		if (host->terms->next)
+			fprintf(out, "window of pid %d\n",
+				(int)shl_pty_get_child(term->pty));
+
+		term_fill_ctx(term, &ctx);
+		wlt_stats_dump(term->stats, out, &ctx);
+	}
+
+	if (out != stderr)
+		fclose(out);
+
+	return G_SOURCE_CONTINUE;
+}
+
 static void term_destroy_cb(GtkWidget *widget, gpointer data)
 {
 	struct term *term = data;
@@ -399,7 +831,7 @@ static void term_destroy_cb(GtkWidget *widget, gpointer data)
 	term->tarea = NULL;
 
 	if (!term->exited)
-		gtk_main_quit();
+		term_close(term);
 }
 
 #define ALL_MODS (GDK_SHIFT_MASK | GDK_LOCK_MASK | GDK_CONTROL_MASK | \
@@ -444,23 +876,37 @@ static gboolean term_key_cb(GtkWidget *widget, GdkEvent *ev, gpointer data)
 	if (b) {
 		if (key == GDK_KEY_Up &&
 		    ((e->state & ~cmod & ALL_MODS) == GDK_SHIFT_MASK)) {
+			term_lock(term);
 			tsm_screen_sb_up(term->screen, 1);
-			gtk_widget_queue_draw(term->tarea);
+			term_scrolled(term);
+			term->in_sb = 1;
+			term_unlock(term);
+			term_schedule_update(term);
 			return TRUE;
 		} else if (key == GDK_KEY_Down &&
 		    ((e->state & ~cmod & ALL_MODS) == GDK_SHIFT_MASK)) {
+			term_lock(term);
 			tsm_screen_sb_down(term->screen, 1);
-			gtk_widget_queue_draw(term->tarea);
+			term_scrolled(term);
+			term_unlock(term);
+			term_schedule_update(term);
 			return TRUE;
 		} else if (key == GDK_KEY_Page_Up &&
 		    ((e->state & ~cmod & ALL_MODS) == GDK_SHIFT_MASK)) {
+			term_lock(term);
 			tsm_screen_sb_page_up(term->screen, 1);
-			gtk_widget_queue_draw(term->tarea);
+			term_scrolled(term);
+			term->in_sb = 1;
+			term_unlock(term);
+			term_schedule_update(term);
 			return TRUE;
 		} else if (key == GDK_KEY_Page_Down &&
 		    ((e->state & ~cmod & ALL_MODS) == GDK_SHIFT_MASK)) {
+			term_lock(term);
 			tsm_screen_sb_page_down(term->screen, 1);
-			gtk_widget_queue_draw(term->tarea);
+			term_scrolled(term);
+			term_unlock(term);
+			term_schedule_update(term);
 			return TRUE;
 		}
 	}
@@ -469,12 +915,17 @@ static gboolean term_key_cb(GtkWidget *widget, GdkEvent *ev, gpointer data)
 	if (!ucs4)
 		ucs4 = TSM_VTE_INVALID;
 
-	if (tsm_vte_handle_keyboard(term->vte, e->keyval, 0, mods, ucs4)) {
+	term_lock(term);
+	b = tsm_vte_handle_keyboard(term->vte, e->keyval, 0, mods, ucs4);
+	if (b)
 		tsm_screen_sb_reset(term->screen);
-		return TRUE;
+	if (b && term->in_sb) {
+		term_scrolled(term);
+		term->in_sb = 0;
 	}
+	term_unlock(term);
 
-	return FALSE;
+	return b;
 }
 
 static gboolean term_button_cb(GtkWidget *widget, GdkEvent *ev,
@@ -494,21 +945,27 @@ static gboolean term_button_cb(GtkWidget *widget, GdkEvent *ev,
 	} else if (e->type == GDK_2BUTTON_PRESS) {
 		term->sel = 2;
 		/* TODO: select word */
+		term_lock(term);
 		tsm_screen_selection_start(term->screen,
 		                           term->scale * e->x / term->cell_width,
 		                           term->scale * e->y / term->cell_height);
-		gtk_widget_queue_draw(term->tarea);
+		term_unlock(term);
+		term_schedule_update(term);
 	} else if (e->type == GDK_3BUTTON_PRESS) {
 		term->sel = 2;
 		/* TODO: select line */
+		term_lock(term);
 		tsm_screen_selection_start(term->screen,
 		                           term->scale * e->x / term->cell_width,
 		                           term->scale * e->y / term->cell_height);
-		gtk_widget_queue_draw(term->tarea);
+		term_unlock(term);
+		term_schedule_update(term);
 	} else if (e->type == GDK_BUTTON_RELEASE) {
 		if (term->sel == 1 && term->sel_start + 500 > e->time) {
+			term_lock(term);
 			tsm_screen_selection_reset(term->screen);
-			gtk_widget_queue_draw(term->tarea);
+			term_unlock(term);
+			term_schedule_update(term);
 		} else if (term->sel > 1) {
 			/* TODO: copy */
 		}
@@ -532,16 +989,20 @@ static gboolean term_motion_cb(GtkWidget *widget, GdkEvent *ev,
 		if (fabs(term->sel_x - term->scale * e->x) > 3 ||
 		    fabs(term->sel_y - term->scale * e->y) > 3) {
 			term->sel = 2;
+			term_lock(term);
 			tsm_screen_selection_start(term->screen,
 			                           term->sel_x / term->cell_width,
 			                           term->sel_y / term->cell_height);
-			gtk_widget_queue_draw(term->tarea);
+			term_unlock(term);
+			term_schedule_update(term);
 		}
 	} else {
+		term_lock(term);
 		tsm_screen_selection_target(term->screen,
 		                            term->scale * e->x / term->cell_width,
 		                            term->scale * e->y / term->cell_height);
-		gtk_widget_queue_draw(term->tarea);
+		term_unlock(term);
+		term_schedule_update(term);
 	}
 
 	return FALSE;
@@ -566,6 +1027,13 @@ static void term_write_cb(struct tsm_vte *vte, const char *u8, size_t len,
 	if (!term->initialized)
 		return;
 
+	if (term->reader) {
+		r = wlt_reader_write(term->reader, u8, len);
+		if (r < 0)
+			err("cannot queue pty-write (%d)", r);
+		return;
+	}
+
 	r = shl_pty_write(term->pty, u8, len);
 	if (r < 0)
 		err("OOM in pty-write (%d)", r);
@@ -574,47 +1042,47 @@ static void term_write_cb(struct tsm_vte *vte, const char *u8, size_t len,
 		term->pty_idle_src = g_idle_add(term_pty_idle_cb, term);
 }
 
-static gboolean term_bridge_cb(GIOChannel *chan, GIOCondition cond,
-			       gpointer data)
-{
-	struct term *term = data;
-	int r;
-
-	r = shl_pty_bridge_dispatch(term->pty_bridge, 0);
-	if (r < 0)
-		err("bridge dispatch failed (%d)", r);
-
-	return TRUE;
-}
-
 static void term_free(struct term *term)
 {
+	term_stop_reader(term);
 	if (term->pty) {
 		shl_pty_bridge_remove(term->pty_bridge, term->pty);
 		shl_pty_close(term->pty);
 		shl_pty_unref(term->pty);
 	}
+	if (term->close_src)
+		g_source_remove(term->close_src);
 	if (term->child_src)
 		g_source_remove(term->child_src);
 	if (term->pty_idle_src)
 		g_source_remove(term->pty_idle_src);
+	if (term->tick_id && term->tarea)
+		gtk_widget_remove_tick_callback(term->tarea, term->tick_id);
 	g_source_unref(term->pty_idle);
-	g_source_remove(term->bridge_src);
-	g_io_channel_unref(term->bridge_chan);
-	shl_pty_bridge_free(term->pty_bridge);
+	if (term->bridge_src)
+		g_source_remove(term->bridge_src);
+	if (term->bridge_chan)
+		g_io_channel_unref(term->bridge_chan);
+	if (term->own_bridge)
+		shl_pty_bridge_free(term->pty_bridge);
 	tsm_vte_unref(term->vte);
 	tsm_screen_unref(term->screen);
 	wlt_renderer_free(term->rend);
-	for (int i = 0; i < 8; ++i)
+	for (int i = 0; i < 4; ++i)
 		wlt_face_unref(term->faces[i]);
 	wlt_font_unref(term->font);
 	if (term->window)
 		gtk_widget_destroy(term->window);
+	wlt_stats_free(term->stats);
 	wlt_config_unref(term->config);
 	free(term);
 }
 
-static int term_new(struct term **out, struct wlt_config *config)
+/*
+ * Open a window for @pty, whose child was started by spawn_shell(). The term
+ * takes over the reference to @pty on success.
+ */
+static int term_new(struct term **out, struct host *host, struct shl_pty *pty)
 {
 	struct term *term;
 	int sb_size, r;
@@ -623,14 +1091,18 @@ static int term_new(struct term **out, struct wlt_config *config)
 	if (!term)
 		return -ENOMEM;
 	term->adjust_size = 1;
+	term->host = host;
 
-	term->config = config;
+	term->config = host->config;
 	wlt_config_ref(term->config);
 
-	r = wlt_font_new(&term->font);
+	r = wlt_stats_new(&term->stats);
 	if (r < 0)
 		goto free;
 
+	wlt_font_ref(host->font);
+	term->font = host->font;
+
 	r = tsm_screen_new(&term->screen, log_tsm, term);
 	if (r < 0)
 		goto err_font;
@@ -650,16 +1122,31 @@ static int term_new(struct term **out, struct wlt_config *config)
 			goto err_vte;
 	}
 
-	term->pty_bridge = shl_pty_bridge_new();
-	if (term->pty_bridge < 0) {
-		r = term->pty_bridge;
-		goto err_vte;
+	/* a pty reader needs a bridge of its own to poll */
+	term->pty_bridge = host->pty_bridge;
+	if (wlt_config_get_pty_thread(term->config) ||
+	    wlt_config_get_parse_thread(term->config)) {
+		r = shl_pty_bridge_new();
+		if (r < 0) {
+			err("cannot create pty bridge (%d)", r);
+		} else {
+			term->pty_bridge = r;
+			term->own_bridge = 1;
+			r = wlt_reader_new(&term->reader, term->pty_bridge,
+					   WLT_READER_SIZE);
+			if (r < 0)
+				err("cannot create pty reader (%d)", r);
+		}
 	}
 
-	term->bridge_chan = g_io_channel_unix_new(term->pty_bridge);
-	term->bridge_src = g_io_add_watch(term->bridge_chan,
-					  G_IO_IN,
-					  term_bridge_cb, term);
+	if (term->reader && wlt_config_get_parse_thread(term->config)) {
+		r = wlt_parser_new(&term->parser, term->screen, term->vte,
+				   term->reader);
+		if (r < 0)
+			err("cannot create parser (%d)", r);
+	}
+
+	term_watch_input(term);
 
 	term->pty_idle = g_idle_source_new();
 
@@ -687,6 +1174,10 @@ static int term_new(struct term **out, struct wlt_config *config)
 	term->scale = gtk_widget_get_scale_factor(GTK_WIDGET(term->tarea));
 	term->iscale = 1.0 / term->scale;
 
+	term->pty = pty;
+	term->child_src = g_child_watch_add(shl_pty_get_child(pty),
+					    term_child_cb, term);
+
 	*out = term;
 	return 0;
 
@@ -696,6 +1187,7 @@ err_screen:
 	tsm_screen_unref(term->screen);
 err_font:
 	wlt_font_unref(term->font);
+	wlt_stats_free(term->stats);
 free:
 	wlt_config_unref(term->config);
 	free(term);
@@ -714,10 +1206,234 @@ static void term_hide(struct term *term)
 		gtk_widget_hide(term->window);
 }
 
+/*
+ * Start the child with posix_spawn(). Unlike fork(), this does not copy our
+ * page tables, so it stays fast however much memory GTK, Pango and the glyph
+ * caches use.
+ *
+ * This runs before the window exists, so the child starts up while we
+ * initialize GTK and load fonts. The pty gets a provisional size, which the
+ * first configure-event corrects, and no input callback; term_new() takes it
+ * over. @cwd and @argv override the config's defaults and may be NULL. The
+ * child gets @env, or our own environment if that is NULL, with TERM set.
+ */
+static int spawn_shell(struct shl_pty **out, struct wlt_config *config,
+		       const char *cwd, char **env, char *const *argv)
+{
+	char **envp;
+	int r;
+
+	if (!argv)
+		argv = wlt_config_get_argv(config);
+	/* stay in our own directory if the requested one is gone */
+	if (cwd && access(cwd, X_OK))
+		cwd = NULL;
+
+	envp = env ? g_strdupv(env) : g_get_environ();
+	envp = g_environ_setenv(envp, "TERM", "xterm-256color", TRUE);
+	r = shl_pty_spawn(out, NULL, NULL, WLT_EARLY_COLUMNS, WLT_EARLY_ROWS,
+			  cwd, argv, envp);
+	g_strfreev(envp);
+
+	return r < 0 ? r : 0;
+}
+
+static void host_free(struct host *host)
+{
+	struct term *term;
+
+	while (host->terms) {
+		term = host->terms->data;
+		host->terms = g_list_remove(host->terms, term);
+		term->exited = 1;
+		term_hide(term);
+		term_free(term);
+	}
+
+	wlt_server_free(host->server);
+	if (host->bridge_src)
+		g_source_remove(host->bridge_src);
+	if (host->bridge_chan)
+		g_io_channel_unref(host->bridge_chan);
+	if (host->pty_bridge >= 0)
+		shl_pty_bridge_free(host->pty_bridge);
+	if (host->int_src)
+		g_source_remove(host->int_src);
+	if (host->term_src)
+		g_source_remove(host->term_src);
+	if (host->stats_src)
+		g_source_remove(host->stats_src);
+	/* pending glyphs hold references to their faces */
+	if (host->font)
+		wlt_font_set_raster_threads(host->font, 0, NULL, NULL);
+	for (int i = 0; i < 4; ++i)
+		wlt_face_unref(host->faces[i]);
+	wlt_font_unref(host->font);
+	wlt_pool_free(host->render_pool);
+	wlt_config_unref(host->config);
+	free(host);
+}
+
+static int host_new(struct host **out, struct wlt_config *config)
+{
+	struct host *host;
+	unsigned int n;
+	int r;
+
+	host = calloc(1, sizeof(*host));
+	if (!host)
+		return -ENOMEM;
+	host->pty_bridge = -1;
+
+	host->config = config;
+	wlt_config_ref(host->config);
+
+	r = wlt_font_new(&host->font);
+	if (r < 0)
+		goto error;
+
+	wlt_font_set_glyph_cache(host->font, 1024 *
+			(size_t)wlt_config_get_glyph_cache_size(host->config));
+	wlt_font_set_color_cache(host->font, 1024 *
+			(size_t)wlt_config_get_color_cache_size(host->config));
+
+	if (wlt_config_get_async_raster(host->config)) {
+		r = wlt_font_set_raster_threads(host->font,
+						g_get_num_processors(),
+						host_glyphs_cb, host);
+		if (r < 0)
+			err("cannot start raster threads (%d)", r);
+	}
+
+	/* The main thread renders a band itself, so one thread less is enough
+	 * to use all cores. All windows share this pool. */
+	n = g_get_num_processors();
+	if (wlt_config_get_parallel_render(host->config) && n > 1) {
+		r = wlt_pool_new(&host->render_pool, n - 1);
+		if (r < 0)
+			err("cannot start render threads (%d)", r);
+	}
+
+	host->pty_bridge = shl_pty_bridge_new();
+	if (host->pty_bridge < 0) {
+		r = host->pty_bridge;
+		goto error;
+	}
+
+	/* same priority as term_watch_input() */
+	host->bridge_chan = g_io_channel_unix_new(host->pty_bridge);
+	host->bridge_src = g_io_add_watch_full(host->bridge_chan,
+					       GDK_PRIORITY_REDRAW + 10,
+					       G_IO_IN, term_bridge_cb,
+					       host, NULL);
+
+	host->stats_src = g_unix_signal_add(SIGUSR1, host_stats_cb, host);
+
+	*out = host;
+	return 0;
+
+error:
+	host_free(host);
+	return r;
+}
+
+/*
+ * Open a new window for @pty, which is consumed either way. If it is NULL, a
+ * child is spawned for @cwd and @argv, which may be NULL, too.
+ */
+static int host_open(struct host *host, struct shl_pty *pty, const char *cwd,
+		     char **envp, char **argv)
+{
+	struct term *term;
+	int r;
+
+	if (!pty) {
+		r = spawn_shell(&pty, host->config, cwd, envp, argv);
+		if (r < 0) {
+			err("cannot spawn pty (%d)", r);
+			return r;
+		}
+	}
+
+	r = term_new(&term, host, pty);
+	if (r < 0) {
+		shl_pty_close(pty);
+		shl_pty_unref(pty);
+		return r;
+	}
+
+	host->terms = g_list_prepend(host->terms, term);
+	term_show(term);
+
+	return 0;
+}
+
+static int host_request_cb(struct wlt_server *server, const char *cwd,
+			   char **envp, char **argv, void *data)
+{
+	struct host *host = data;
+	int r;
+
+	r = host_open(host, NULL, cwd, envp, argv);
+	if (r < 0)
+		err("cannot open window for client (%d)", r);
+
+	return r;
+}
+
+/* a server has no window to close, so it quits on signals */
+static gboolean host_quit_cb(gpointer data)
+{
+	gtk_main_quit();
+	return G_SOURCE_CONTINUE;
+}
+
+static int host_listen(struct host *host)
+{
+	char *path;
+	int r;
+
+	path = wlt_server_get_path();
+	r = wlt_server_new(&host->server, path, host_request_cb, host);
+	if (r < 0)
+		err("cannot listen on %s (%d)", path, r);
+	else
+		info("listening on %s", path);
+	g_free(path);
+
+	if (r < 0)
+		return r;
+
+	host->int_src = g_unix_signal_add(SIGINT, host_quit_cb, host);
+	host->term_src = g_unix_signal_add(SIGTERM, host_quit_cb, host);
+
+	return 0;
+}
+
+/*
+ * Runs without GTK, so a new window shows up as fast as the server can open
+ * it. Returns -ENOENT or -ECONNREFUSED if there is no server to ask.
+ */
+static int run_client(int argc, char **argv)
+{
+	char *path, *cwd;
+	int r;
+
+	path = wlt_server_get_path();
+	cwd = g_get_current_dir();
+	r = wlt_client_open(path, cwd, environ, argc > 1 ? &argv[1] : NULL);
+	g_free(cwd);
+	g_free(path);
+
+	return r;
+}
+
 int main(int argc, char **argv)
 {
 	struct wlt_config *config;
-	struct term *term;
+	struct shl_pty *pty = NULL;
+	struct host *host;
+	GdkDisplay *display;
 	int r;
 
 	r = wlt_config_new(&config, &argc, &argv);
@@ -727,19 +1443,59 @@ int main(int argc, char **argv)
 	for (int i = 0; i < argc; ++i)
 		printf("%s\n", argv[i]);
 
-	r = term_new(&term, config);
+	if (wlt_config_get_client(config)) {
+		r = run_client(argc, argv);
+		if (r >= 0) {
+			wlt_config_unref(config);
+			return 0;
+		} else if (r != -ENOENT && r != -ECONNREFUSED) {
+			goto error;
+		}
+
+		info("no server running, opening the window ourselves");
+	}
+
+	/* the shell starts up while we connect to the display and load fonts */
+	if (!wlt_config_get_server(config)) {
+		r = spawn_shell(&pty, config, NULL, NULL, NULL);
+		if (r < 0) {
+			err("cannot spawn pty (%d)", r);
+			goto error;
+		}
+	}
+
+	display = gdk_display_open(gdk_get_display_arg_name());
+	if (!display) {
+		r = -ENODEV;
+		goto err_pty;
+	}
+	gdk_display_manager_set_default_display(gdk_display_manager_get(),
+						display);
+
+	r = host_new(&host, config);
 	if (r < 0)
+		goto err_pty;
+
+	if (pty)
+		r = host_open(host, pty, NULL, NULL, NULL);
+	else
+		r = host_listen(host);
+	if (r < 0) {
+		host_free(host);
 		goto error;
+	}
 
-	term_show(term);
 	gtk_main();
-	term->exited = 1;
-	term_hide(term);
-	term_free(term);
+	host_free(host);
 	wlt_config_unref(config);
 
 	return 0;
 
+err_pty:
+	if (pty) {
+		shl_pty_close(pty);
+		shl_pty_unref(pty);
+	}
 error:
 	wlt_config_unref(config);
 	errno = -r;
@@ -32,6 +32,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 
@@ -41,18 +42,42 @@ struct wlt_config;
 struct wlt_font;
 struct wlt_face;
 struct wlt_renderer;
+struct wlt_pool;
+struct wlt_disk_cache;
+struct wlt_reader;
+struct wlt_parser;
+struct wlt_snapshot;
+struct wlt_server;
+struct shl_pty;
 
 /* config */
 
 int wlt_config_new(struct wlt_config **out, int *argc, char ***argv);
+int wlt_config_new_default(struct wlt_config **out);
 void wlt_config_ref(struct wlt_config *config);
 void wlt_config_unref(struct wlt_config *config);
 
 bool wlt_config_get_show_dirty(struct wlt_config *config);
 bool wlt_config_get_snap_size(struct wlt_config *config);
+bool wlt_config_get_parallel_render(struct wlt_config *config);
+bool wlt_config_get_async_raster(struct wlt_config *config);
+bool wlt_config_get_pty_thread(struct wlt_config *config);
+bool wlt_config_get_parse_thread(struct wlt_config *config);
 int wlt_config_get_sb_size(struct wlt_config *config);
+/* 0 means no limit besides the display's refresh rate */
+int wlt_config_get_max_fps(struct wlt_config *config);
+/* in microseconds; 0 means a quarter of the frame interval */
+int wlt_config_get_read_budget(struct wlt_config *config);
+/* cache budgets in KiB */
+int wlt_config_get_glyph_cache_size(struct wlt_config *config);
+int wlt_config_get_color_cache_size(struct wlt_config *config);
 /* This will be null if no palette is specified */
 const char *wlt_config_get_palette(struct wlt_config *config);
+/* This will be null if statistics go to stderr */
+const char *wlt_config_get_stats_file(struct wlt_config *config);
+/* command line only; see wlterm.c */
+bool wlt_config_get_server(struct wlt_config *config);
+bool wlt_config_get_client(struct wlt_config *config);
 /* 
  * The return value should be thought of as const char *const *, but
  * is left as char *const * for compatibility with exec.
@@ -100,41 +125,133 @@ struct wlt_glyph {
 	void *cr_surface;
 };
 
+/* a glyph pre-blended with fixed colors; @buffer is ARGB32 with
+ * @width pixels per row */
+struct wlt_color_glyph {
+	unsigned long id;
+	uint32_t fc;
+	uint32_t bc;
+
+	unsigned int width;
+	unsigned int height;
+	uint32_t *buffer;
+	bool ready;
+};
+
+struct wlt_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long failures;
+	size_t size;
+	size_t max_size;
+};
+
 #define WLT_FACE_DONT_CARE (-1)
 
+typedef void (*wlt_font_cb) (struct wlt_font *font, void *data);
+
 int wlt_font_new(struct wlt_font **out);
 void wlt_font_ref(struct wlt_font *font);
 void wlt_font_unref(struct wlt_font *font);
+void wlt_font_next_frame(struct wlt_font *font);
+int wlt_font_set_raster_threads(struct wlt_font *font, unsigned int threads,
+				wlt_font_cb cb, void *data);
+void wlt_font_set_disk_cache(struct wlt_font *font, bool enable);
+void wlt_font_set_glyph_cache(struct wlt_font *font, size_t size);
+void wlt_font_get_glyph_stats(struct wlt_font *font,
+			      struct wlt_cache_stats *out);
+void wlt_font_set_color_cache(struct wlt_font *font, size_t size);
+void wlt_font_get_color_stats(struct wlt_font *font,
+			      struct wlt_cache_stats *out);
 
+/* underline and friends are drawn by the renderer, not by separate faces */
 enum wlt_face_attrs {
 	WLT_FACE_PLAIN = 0,
 	WLT_FACE_BOLD = 1 << 0,
-	WLT_FACE_UNDERLINE = 1 << 1,
-	WLT_FACE_ITALICS = 1 << 2,
+	WLT_FACE_ITALICS = 1 << 1,
+};
+
+/* in pixels; line positions are offsets from the top of the cell */
+struct wlt_face_metrics {
+	unsigned int width;
+	unsigned int height;
+	unsigned int baseline;
+	unsigned int underline_pos;
+	unsigned int underline_size;
 };
 
 int wlt_face_new(struct wlt_face **out, struct wlt_font *font,
 		 const char *desc_str, int desc_size, int attrs);
+int wlt_face_new_lazy(struct wlt_face **out, struct wlt_font *font,
+		      const char *desc_str, int desc_size, int attrs);
 void wlt_face_ref(struct wlt_face *face);
 void wlt_face_unref(struct wlt_face *face);
 unsigned int wlt_face_get_width(struct wlt_face *face);
 unsigned int wlt_face_get_height(struct wlt_face *face);
+void wlt_face_get_metrics(struct wlt_face *face, struct wlt_face_metrics *out);
+
+void wlt_face_get_stats(struct wlt_face *face, struct wlt_cache_stats *out);
 
+int wlt_face_get_key(struct wlt_face *face, unsigned long *out,
+		     const uint32_t *ch, size_t len);
 int wlt_face_render(struct wlt_face *face, struct wlt_glyph **out,
 		    unsigned long id, const uint32_t *ch, size_t len,
-		    size_t cwidth);
+		    size_t cwidth, unsigned int cell_width,
+		    unsigned int cell_height);
+int wlt_face_lookup_color(struct wlt_face *face,
+			  struct wlt_color_glyph **out,
+			  unsigned long id, uint32_t fc, uint32_t bc);
+int wlt_face_add_color(struct wlt_face *face, struct wlt_color_glyph **out,
+		       const struct wlt_glyph *glyph, uint32_t fc, uint32_t bc,
+		       unsigned int max_height);
+
+/* built-in glyphs */
+
+int wlt_boxdraw_render(struct wlt_glyph *glyph, uint32_t ch,
+		       unsigned int width, unsigned int height);
+
+/* persistent glyph cache */
+
+struct wlt_disk_glyph {
+	const uint32_t *ch;
+	size_t len;
+	const struct wlt_glyph *glyph;
+};
+
+int wlt_disk_cache_open(struct wlt_disk_cache **out, const char *key);
+void wlt_disk_cache_close(struct wlt_disk_cache *cache);
+void wlt_disk_cache_get_metrics(struct wlt_disk_cache *cache,
+				struct wlt_face_metrics *out);
+int wlt_disk_cache_lookup(struct wlt_disk_cache *cache,
+			  struct wlt_glyph *glyph,
+			  const uint32_t *ch, size_t len, size_t cwidth);
+int wlt_disk_cache_write(const char *key, const struct wlt_face_metrics *m,
+			 struct wlt_disk_glyph *glyphs, size_t n);
 
 /* rendering */
 
+struct wlt_rect {
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+};
+
 struct wlt_draw_ctx {
 	struct wlt_config *config;
 	struct wlt_renderer *rend;
 	cairo_t *cr;
-	struct wlt_face *faces[8];
+	struct wlt_font *font;
+	struct wlt_face *faces[4];
 	unsigned int cell_width;
 	unsigned int cell_height;
 	struct tsm_screen *screen;
 	struct tsm_vte *vte;
+	/* if set, this is drawn instead of @screen */
+	struct wlt_snapshot *snap;
+	/* the screen may have scrolled since the last update */
+	bool may_scroll;
 
 	double x1;
 	double y1;
@@ -142,12 +259,101 @@ struct wlt_draw_ctx {
 	double y2;
 };
 
+/* cumulative cell counters of all updates so far */
+struct wlt_render_stats {
+	unsigned long frames;
+	unsigned long cells;
+	unsigned long drawn;
+	unsigned long skipped;
+};
+
 int wlt_renderer_new(struct wlt_renderer **out, unsigned int width,
 		     unsigned int height);
 void wlt_renderer_free(struct wlt_renderer *rend);
 int wlt_renderer_resize(struct wlt_renderer *rend, unsigned int width,
 			unsigned int height);
+int wlt_renderer_set_pool(struct wlt_renderer *rend, struct wlt_pool *pool);
 void wlt_renderer_dirty(struct wlt_renderer *rend);
+void wlt_renderer_update(const struct wlt_draw_ctx *ctx);
+size_t wlt_renderer_get_damage(struct wlt_renderer *rend,
+			       const struct wlt_rect **out);
 void wlt_renderer_draw(const struct wlt_draw_ctx *ctx);
+cairo_surface_t *wlt_renderer_get_surface(struct wlt_renderer *rend);
+void wlt_renderer_get_stats(struct wlt_renderer *rend,
+			    struct wlt_render_stats *out);
+
+int wlt_snapshot_new(struct wlt_snapshot **out);
+void wlt_snapshot_free(struct wlt_snapshot *snap);
+int wlt_snapshot_capture(struct wlt_snapshot *snap, struct tsm_screen *screen,
+			 bool may_scroll);
+bool wlt_vte_may_scroll(const char *u8, size_t len);
+
+/* statistics */
+
+struct wlt_stats;
+
+enum wlt_stats_timer {
+	WLT_STATS_UPDATE,
+	WLT_STATS_DRAW,
+	WLT_STATS_TIMER_NUM,
+};
+
+int wlt_stats_new(struct wlt_stats **out);
+void wlt_stats_free(struct wlt_stats *stats);
+void wlt_stats_add_time(struct wlt_stats *stats, enum wlt_stats_timer timer,
+			int64_t usec);
+void wlt_stats_add_input(struct wlt_stats *stats, size_t bytes);
+void wlt_stats_dump(struct wlt_stats *stats, FILE *out,
+		    const struct wlt_draw_ctx *ctx);
+
+/* pty reader */
+
+typedef void (*wlt_reader_cb) (const char *u8, size_t len, void *data);
+
+int wlt_reader_new(struct wlt_reader **out, int bridge, size_t size);
+void wlt_reader_free(struct wlt_reader *reader);
+int wlt_reader_start(struct wlt_reader *reader, struct shl_pty *pty);
+int wlt_reader_get_fd(struct wlt_reader *reader);
+void wlt_reader_push(struct wlt_reader *reader, const char *u8, size_t len);
+int wlt_reader_write(struct wlt_reader *reader, const char *u8, size_t len);
+void wlt_reader_dispatch(struct wlt_reader *reader, wlt_reader_cb cb,
+			 void *data);
+
+/* parser thread */
+
+int wlt_parser_new(struct wlt_parser **out, struct tsm_screen *screen,
+		   struct tsm_vte *vte, struct wlt_reader *reader);
+void wlt_parser_free(struct wlt_parser *parser);
+int wlt_parser_start(struct wlt_parser *parser);
+int wlt_parser_get_fd(struct wlt_parser *parser);
+size_t wlt_parser_dispatch(struct wlt_parser *parser);
+void wlt_parser_lock(struct wlt_parser *parser);
+void wlt_parser_unlock(struct wlt_parser *parser);
+void wlt_parser_scrolled(struct wlt_parser *parser);
+struct wlt_snapshot *wlt_parser_acquire(struct wlt_parser *parser);
+
+/* window server */
+
+/* @cwd and @argv may be NULL, @envp is the environment of the client;
+ * returns 0 or a negative error code */
+typedef int (*wlt_server_cb) (struct wlt_server *server, const char *cwd,
+			      char **envp, char **argv, void *data);
+
+char *wlt_server_get_path(void);
+int wlt_server_new(struct wlt_server **out, const char *path, wlt_server_cb cb,
+		   void *data);
+void wlt_server_free(struct wlt_server *server);
+int wlt_client_open(const char *path, const char *cwd, char *const *envp,
+		    char *const *argv);
+
+/* thread pool */
+
+typedef void (*wlt_pool_cb) (unsigned int worker, void *data);
+
+int wlt_pool_new(struct wlt_pool **out, unsigned int threads);
+void wlt_pool_free(struct wlt_pool *pool);
+unsigned int wlt_pool_get_size(struct wlt_pool *pool);
+int wlt_pool_push(struct wlt_pool *pool, wlt_pool_cb cb, void *data);
+void wlt_pool_wait(struct wlt_pool *pool);
 
 #endif /* WLT_WLTERM_H */